@@ -1,6 +1,29 @@
 
 #include "fs.h"
 
+// The blocks in memory, at most bc_limit of them.  When another is
+// needed, a CLOCK hand goes round them looking for one to evict, using
+// the PTE accessed bit as each block's reference bit.
+#define BC_MAXRESIDENT	8192
+#define BC_LIMIT	1024	// default limit, 4MB
+#define BC_MINLIMIT	64	// well above what one request holds on to
+
+static uint32_t bc_blocks[BC_MAXRESIDENT];
+static uint32_t bc_nblocks;
+static uint32_t bc_hand;
+static uint32_t bc_limit = BC_LIMIT;
+static struct Fsret_cache bc_stats;
+
+// The run of blocks bc_read_run is reading in, which bc_evict must
+// leave alone until it is done.
+static uint32_t bc_run_start, bc_run_n;
+
+// When each resident block was first seen dirty by bc_writeback, or 0.
+static uint32_t bc_dirty_since[BC_MAXRESIDENT];
+static uint32_t wb_dirty_age = WB_DIRTY_AGE;
+static uint32_t wb_dirty_ratio = WB_DIRTY_RATIO;
+static uint32_t wb_last;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -10,6 +33,15 @@ diskaddr(uint32_t blockno)
 	return (char*) (DISKMAP + blockno * BLKSIZE);
 }
 
+// Count a file block lookup at addr as a hit if the block is in
+// memory.  (Misses are counted when bc_pgfault reads blocks in.)
+void
+bc_lookup(void *addr)
+{
+	if (va_is_mapped(addr))
+		bc_stats.ret_hits++;
+}
+
 // Is this virtual address mapped?
 bool
 va_is_mapped(void *va)
@@ -24,6 +56,197 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// The superblock and the bitmap are used through long-lived pointers
+// all the time, so they stay put.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	if (blockno == 1)
+		return 1;
+	return bitmap && blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Evict a block, and return the bc_blocks slot it leaves free, or -1
+// if every block is pinned, mapped by another environment as well, or
+// part of the run bc_read_run is reading in.
+// Blocks with the accessed bit set get a second chance: the bit is
+// cleared by remapping the page, which would lose the dirty bit, so a
+// dirty block is written back at that point.  Cold blocks are written
+// back if need be and unmapped.
+static int
+bc_evict(void)
+{
+	uint32_t blockno, i;
+	void *addr;
+	int r;
+
+	for (i = 0; i < 2 * bc_nblocks; i++, bc_hand++) {
+		if (bc_hand >= bc_nblocks)
+			bc_hand = 0;
+		blockno = bc_blocks[bc_hand];
+		addr = (void *) (DISKMAP + blockno * BLKSIZE);
+
+		// Someone else unmapped it (check_bc does)
+		if (!va_is_mapped(addr))
+			return bc_hand++;
+		if (bc_pinned(blockno) || pageref(addr) > 1
+		    || blockno - bc_run_start < bc_run_n)
+			continue;
+		if (uvpt[PGNUM(addr)] & PTE_A) {
+			if (va_is_dirty(addr))
+				flush_block(addr);
+			else if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+				panic("in bc_evict, sys_page_map: %e", r);
+			continue;
+		}
+
+		flush_block(addr);
+		if ((r = sys_page_unmap(0, addr)) < 0)
+			panic("in bc_evict, sys_page_unmap: %e", r);
+		bc_stats.ret_evictions++;
+		return bc_hand++;
+	}
+	return -1;
+}
+
+// Note that blockno is coming into memory, evicting another block if
+// we are at the limit.
+static void
+bc_track(uint32_t blockno)
+{
+	int i = -1;
+
+	if (bc_nblocks >= bc_limit)
+		i = bc_evict();
+	if (i < 0) {
+		if (bc_nblocks == BC_MAXRESIDENT)
+			return;		// can't track it, so it stays
+		i = bc_nblocks++;
+	}
+	bc_blocks[i] = blockno;
+	bc_dirty_since[i] = 0;
+}
+
+// Keep at most nblocks blocks in memory, evicting any over that now.
+void
+bc_set_limit(uint32_t nblocks)
+{
+	int i;
+
+	bc_limit = MIN(MAX(nblocks, BC_MINLIMIT), BC_MAXRESIDENT);
+	while (bc_nblocks > bc_limit && (i = bc_evict()) >= 0) {
+		bc_nblocks--;
+		bc_blocks[i] = bc_blocks[bc_nblocks];
+		bc_dirty_since[i] = bc_dirty_since[bc_nblocks];
+	}
+}
+
+// Set the write-back thresholds; 0 leaves one as it is.
+void
+bc_set_writeback(uint32_t dirty_age, uint32_t dirty_ratio)
+{
+	if (dirty_age)
+		wb_dirty_age = dirty_age;
+	if (dirty_ratio)
+		wb_dirty_ratio = MIN(dirty_ratio, 100);
+}
+
+void
+bc_stat(struct Fsret_cache *st)
+{
+	*st = bc_stats;
+	st->ret_resident = bc_nblocks;
+	st->ret_limit = bc_limit;
+	st->ret_dirty_age = wb_dirty_age;
+	st->ret_dirty_ratio = wb_dirty_ratio;
+}
+
+struct WbBlock {
+	uint32_t wb_blockno;
+	uint32_t wb_slot;	// index in bc_blocks
+};
+
+static struct WbBlock wb_list[BC_MAXRESIDENT];
+
+static void
+wb_sort(struct WbBlock *a, int n)
+{
+	struct WbBlock t;
+	int gap, i, j;
+
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++) {
+			t = a[i];
+			for (j = i; j >= gap && a[j - gap].wb_blockno > t.wb_blockno; j -= gap)
+				a[j] = a[j - gap];
+			a[j] = t;
+		}
+}
+
+// Write back dirty blocks, at most once every WB_INTERVAL ms: those
+// that have been dirty for wb_dirty_age ms, or all of them if more than
+// wb_dirty_ratio percent of the cache is dirty.  They go out in block
+// order, with each run of consecutive blocks (up to BC_MAXRUN) in one
+// disk write.  Returns the number of blocks written.
+int
+bc_writeback(uint32_t now)
+{
+	struct PageMapBatch batch;
+	uint32_t i, j, n, ndirty;
+	char *addr;
+	int r;
+
+	if (now - wb_last < WB_INTERVAL)
+		return 0;
+	wb_last = now;
+	if (now == 0)
+		now = 1;	// 0 means clean in bc_dirty_since
+
+	ndirty = 0;
+	for (i = 0; i < bc_nblocks; i++) {
+		addr = (char *) (DISKMAP + bc_blocks[i] * BLKSIZE);
+		if (!va_is_mapped(addr) || !va_is_dirty(addr)) {
+			bc_dirty_since[i] = 0;
+			continue;
+		}
+		if (!bc_dirty_since[i])
+			bc_dirty_since[i] = now;
+		ndirty++;
+	}
+	bc_stats.ret_dirty = ndirty;
+
+	n = 0;
+	for (i = 0; i < bc_nblocks; i++)
+		if (bc_dirty_since[i] &&
+		    (ndirty * 100 > wb_dirty_ratio * bc_limit
+		     || now - bc_dirty_since[i] >= wb_dirty_age)) {
+			wb_list[n].wb_blockno = bc_blocks[i];
+			wb_list[n++].wb_slot = i;
+		}
+	wb_sort(wb_list, n);
+
+	pagemap_init(&batch);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && j - i < BC_MAXRUN
+			     && wb_list[j].wb_blockno == wb_list[j - 1].wb_blockno + 1; j++)
+			/* extend the run */;
+		addr = (char *) (DISKMAP + wb_list[i].wb_blockno * BLKSIZE);
+		if ((r = ide_write(wb_list[i].wb_blockno * BLKSECTS, addr, (j - i) * BLKSECTS)) < 0)
+			panic("in bc_writeback, ide_write: %e", r);
+		for (; i < j; i++, addr += BLKSIZE) {
+			if ((r = pagemap_add(&batch, 0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+				panic("in bc_writeback, sys_page_map: %e", r);
+			bc_dirty_since[wb_list[i].wb_slot] = 0;
+		}
+	}
+	if ((r = pagemap_flush(&batch)) < 0)
+		panic("in bc_writeback, sys_page_map: %e", r);
+
+	bc_stats.ret_writebacks += n;
+	bc_stats.ret_dirty = ndirty - n;
+	return n;
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -50,6 +273,8 @@ bc_pgfault(struct UTrapframe *utf)
 	// LAB 5: you code here:
     void *va_ = ROUNDDOWN(addr, PGSIZE);
 
+    bc_stats.ret_misses++;
+    bc_track(blockno);
     if ((r = sys_page_alloc(0, va_, PTE_U | PTE_W | PTE_P)) < 0) {
         panic("in bc_pgfault, sys_page_alloc: %e", r);
     }
@@ -57,6 +282,7 @@ bc_pgfault(struct UTrapframe *utf)
     if ((r = ide_read(blockno * 8, va_, 8)) < 0) {
         panic("in bc_pgfault, ide_read: %e", r);
     }
+    bc_stats.ret_reads++;
 
 	// Clear the dirty bit for the disk block page since we just read the
 	// block from disk
@@ -96,6 +322,7 @@ flush_block(void *addr)
     if ((r = ide_write(blockno * 8, addr_, 8)) < 0) {
         panic("in flush_block, ide_write: %e", r);
     }
+    bc_stats.ret_writebacks++;
 
     if ((r = sys_page_map(0, addr_, 0, addr_, uvpt[PGNUM(addr_)] & PTE_SYSCALL)) < 0) {
         panic("in flush_block, sys_page_map: %e", r);
@@ -104,6 +331,99 @@ flush_block(void *addr)
 	// panic("flush_block not implemented");
 }
 
+// Make sure the block at addr is in the cache, so that its page can be
+// mapped into other environments.
+void
+bc_load(void *addr)
+{
+	if (!va_is_mapped(addr))
+		(void) *(volatile char *) addr;	// bc_pgfault reads it in
+}
+
+// Block blockno has been freed.  Clients may still have its page mapped
+// from before, so if they do, give the cache a copy of its own to reuse
+// and leave them the old page.
+void
+bc_free(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	if (!va_is_mapped(addr) || pageref(addr) == 1)
+		return;
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("in bc_free, sys_page_alloc: %e", r);
+	memmove(UTEMP, addr, BLKSIZE);
+	if ((r = sys_page_map(0, UTEMP, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("in bc_free, sys_page_map: %e", r);
+	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+		panic("in bc_free, sys_page_unmap: %e", r);
+}
+
+// Read in the blocks from blockno to blockno + n that are not in
+// memory, with one disk transfer for each run of them.  n is at most
+// BC_MAXRUN.
+void
+bc_read_run(uint32_t blockno, uint32_t n)
+{
+	struct PageMapBatch batch;
+	uint32_t i, j;
+	char *addr;
+	int r;
+
+	bc_run_start = blockno;
+	bc_run_n = n;
+	pagemap_init(&batch);
+	for (i = 0; i < n; i = j) {
+		addr = diskaddr(blockno + i);
+		for (j = i; j < n && !va_is_mapped(addr + (j - i) * BLKSIZE); j++) {
+			if ((r = sys_page_alloc(0, addr + (j - i) * BLKSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("in bc_read_run, sys_page_alloc: %e", r);
+			bc_stats.ret_misses++;
+			bc_track(blockno + j);
+		}
+		if (j == i) {
+			j++;
+			continue;
+		}
+		if ((r = ide_read((blockno + i) * BLKSECTS, addr, (j - i) * BLKSECTS)) < 0)
+			panic("in bc_read_run, ide_read: %e", r);
+		bc_stats.ret_reads++;
+		// Clear the dirty bits, as bc_pgfault does
+		for (; i < j; i++, addr += BLKSIZE)
+			if ((r = pagemap_add(&batch, 0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+				panic("in bc_read_run, sys_page_map: %e", r);
+	}
+	if ((r = pagemap_flush(&batch)) < 0)
+		panic("in bc_read_run, sys_page_map: %e", r);
+	bc_run_n = 0;
+}
+
+// Flush the n blocks starting at blockno.  Like calling flush_block on
+// each, but the remaps that clear the dirty bits go to the kernel in
+// batches instead of one system call per block.
+void
+flush_blocks(uint32_t blockno, uint32_t n)
+{
+	struct PageMapBatch batch;
+	void *addr;
+	int r;
+
+	pagemap_init(&batch);
+	for (; n > 0; blockno++, n--) {
+		addr = diskaddr(blockno);
+		if (!va_is_mapped(addr) || !va_is_dirty(addr))
+			continue;
+		if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
+			panic("in flush_blocks, ide_write: %e", r);
+		bc_stats.ret_writebacks++;
+		if ((r = pagemap_add(&batch, 0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+			panic("in flush_blocks, sys_page_map: %e", r);
+	}
+	if ((r = pagemap_flush(&batch)) < 0)
+		panic("in flush_blocks, sys_page_map: %e", r);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -36,7 +36,8 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
-// Mark a block free in the bitmap
+// Mark a block free in the bitmap.  Pages of it that clients still
+// map keep its old contents (see bc_free).
 void
 free_block(uint32_t blockno)
 {
@@ -44,36 +45,68 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free zero block");
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	bc_free(blockno);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it.  The search
+// looks at a word (32 blocks) at a time, starting where the last one
+// left off, so appends don't rescan the full front of the disk.  The
+// changed bitmap block goes to disk with the next write-back.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
 alloc_block(void)
 {
 	// The bitmap consists of one or more blocks.  A single bitmap block
 	// contains the in-use bits for BLKBITSIZE blocks.  There are
 	// super->s_nblocks blocks in the disk altogether.
+	static uint32_t cursor;		// word to look at first
+	uint32_t nwords = (super->s_nblocks + 31) / 32;
+	uint32_t i, w, blockno;
 
-	// LAB 5: Your code here.
-    int i = 0;
-    for (; i<super->s_nblocks; i++) {
-        if (bitmap[i/32] & (1 << (i%32))) {
-            bitmap[i/32] &= ~(1 << (i%32));
-            ide_write(2*8 + i/PGSIZE, ROUNDDOWN(&bitmap[i/32], SECTSIZE), 1);
-            return i;
-        }
-    }
-	// panic("alloc_block not implemented");
+	for (i = 0; i < nwords; i++) {
+		w = (cursor + i) % nwords;
+		if (bitmap[w] == 0)
+			continue;
+		blockno = w * 32 + __builtin_ctz(bitmap[w]);
+		// Bits past the end of the disk in the last word read as free
+		if (blockno >= super->s_nblocks)
+			continue;
+		bitmap[w] &= ~(1 << (blockno % 32));
+		cursor = w;
+		return blockno;
+	}
 	return -E_NO_DISK;
 }
 
+// Allocate a block for file data, trying to keep files contiguous on
+// disk: take 'goal' (the block after the file's previous one) if it is
+// free, or else the first block of a wholly free 32-block word, where
+// the file will have room to grow.  Falls back on alloc_block.
+int
+alloc_block_near(uint32_t goal)
+{
+	static uint32_t cursor;		// word to look at first
+	uint32_t nwords = (super->s_nblocks + 31) / 32;
+	uint32_t i, w;
+
+	if (goal && block_is_free(goal)) {
+		bitmap[goal / 32] &= ~(1 << (goal % 32));
+		return goal;
+	}
+
+	for (i = 0; i < nwords; i++) {
+		w = (cursor + i) % nwords;
+		if (bitmap[w] == ~0U && (w + 1) * 32 <= super->s_nblocks) {
+			bitmap[w] &= ~1U;
+			cursor = w;
+			return w * 32;
+		}
+	}
+	return alloc_block();
+}
+
 // Validate the file system bitmap.
 //
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
@@ -123,11 +156,31 @@ fs_init(void)
 	
 }
 
+// Set *pind to the index block whose number is in *pblockno,
+// allocating a zeroed one first if *pblockno is 0 and 'alloc' is set.
+static int
+index_block(uint32_t *pblockno, bool alloc, uint32_t **pind)
+{
+    int r;
+
+    if (*pblockno == 0) {
+        if (!alloc)
+            return -E_NOT_FOUND;
+        if ((r = alloc_block()) < 0)
+            return r;
+        *pblockno = r;
+        memset(diskaddr(r), 0, BLKSIZE);
+    }
+    *pind = diskaddr(*pblockno);
+    return 0;
+}
+
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in one of the indirect blocks listed in
+// the double-indirect block.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -135,15 +188,16 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range
+//		(it's >= NDIRECT + NINDIRECT + NDINDIRECT).
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
     int r;
-    // LAB 5: Your code here.
+    uint32_t *pind;
+
     if (filebno < NDIRECT) {
         if (ppdiskbno) {
             *ppdiskbno = &f->f_direct[filebno];
@@ -154,23 +208,20 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 
     filebno -= NDIRECT;
     if (filebno < NINDIRECT) {
-        if (f->f_indirect == 0 && !alloc) {
-            return -E_NOT_FOUND;   
-        }
-
-        if (f->f_indirect == 0) {
-            if ((r = alloc_block()) < 0) {
-                return r;
-            }
-            f->f_indirect = r;
-            memset(diskaddr(r), 0, PGSIZE);
-        }
-
-        if (ppdiskbno) {
-            uint32_t *pind = diskaddr(f->f_indirect);
+        if ((r = index_block(&f->f_indirect, alloc, &pind)) < 0)
+            return r;
+        if (ppdiskbno)
             *ppdiskbno = &pind[filebno];
-        }
+        return 0;
+    }
 
+    filebno -= NINDIRECT;
+    if (filebno < NDINDIRECT) {
+        if ((r = index_block(&f->f_dindirect, alloc, &pind)) < 0
+            || (r = index_block(&pind[filebno / NINDIRECT], alloc, &pind)) < 0)
+            return r;
+        if (ppdiskbno)
+            *ppdiskbno = &pind[filebno % NINDIRECT];
         return 0;
     }
 
@@ -183,15 +234,11 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-    // LAB 5: Your code here.
-    // file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
     int r;
-    uint32_t *pdiskbno;
+    uint32_t *pdiskbno, *pprev, goal;
 
     if ((r = file_block_walk(f, filebno, &pdiskbno, 1)) < 0) {
         cprintf("in file_get_block, file_block_walk %e", r);
@@ -199,7 +246,12 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
     }
 
     if (*pdiskbno == 0) {
-        if ((r = alloc_block()) < 0) {
+        // Put it right after the file's previous block if we can
+        goal = 0;
+        if (filebno > 0 && file_block_walk(f, filebno - 1, &pprev, 0) == 0
+            && *pprev && *pprev + 1 < super->s_nblocks)
+            goal = *pprev + 1;
+        if ((r = alloc_block_near(goal)) < 0) {
             cprintf("in file_block_walk, alloc_block %e", r);
             return r;
         }
@@ -208,18 +260,206 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
     }
 
     *blk = diskaddr(*pdiskbno);
+    bc_lookup(*blk);
     return 0;
 }
 
-// Try to find a file named "name" in dir.  If so, set *file to it.
+// Bring blocks filebno up to filebno + n of f into the block cache,
+// reading each run of blocks that are consecutive on disk with one
+// disk transfer instead of a fault per block.  Holes and blocks past
+// the end of the file are skipped.
+void
+file_prefetch(struct File *f, uint32_t filebno, uint32_t n)
+{
+    uint32_t *pdiskbno, end, start, len;
+
+    end = MIN(filebno + n, (f->f_size + BLKSIZE - 1) / BLKSIZE);
+    start = len = 0;
+    for (; filebno < end; filebno++) {
+        if (file_block_walk(f, filebno, &pdiskbno, 0) < 0 || *pdiskbno == 0)
+            continue;
+        if (len && *pdiskbno == start + len && len < BC_MAXRUN) {
+            len++;
+            continue;
+        }
+        if (len)
+            bc_read_run(start, len);
+        start = *pdiskbno;
+        len = 1;
+    }
+    if (len)
+        bc_read_run(start, len);
+}
+
+// --------------------------------------------------------------
+// Directory index
+// --------------------------------------------------------------
+
+// Set *pf to entry number 'entry' of dir.
+static int
+dir_entry(struct File *dir, uint32_t entry, struct File **pf)
+{
+	int r;
+	char *blk;
+
+	if ((r = file_get_block(dir, entry / BLKFILES, &blk)) < 0)
+		return r;
+	*pf = (struct File *) blk + entry % BLKFILES;
+	return 0;
+}
+
+// Set *pslot to slot i of the index table.
+static int
+dirindex_slot(struct DirIndex *di, uint32_t i, uint32_t **pslot)
+{
+	int r;
+	char *blk;
+
+	if ((r = file_get_block(&di->di_table, i / (BLKSIZE / 4), &blk)) < 0)
+		return r;
+	*pslot = (uint32_t *) blk + i % (BLKSIZE / 4);
+	return 0;
+}
+
+// Put entry number 'entry', named 'name', in the index, which must
+// have room for it.
+static int
+dirindex_put(struct DirIndex *di, const char *name, uint32_t entry)
+{
+	uint32_t i, *slot;
+	int r;
+
+	for (i = dir_hash(name); ; i++) {
+		if ((r = dirindex_slot(di, i & (di->di_nslots - 1), &slot)) < 0)
+			return r;
+		if (*slot == 0 || *slot == DIRINDEX_DELETED)
+			break;
+	}
+	if (*slot == DIRINDEX_DELETED)
+		di->di_ndeleted--;
+	*slot = entry + 1;
+	di->di_nused++;
+	return 0;
+}
+
+// (Re)build dir's index with nslots slots from the entries in dir,
+// creating the index if dir has none.
+static int
+dirindex_build(struct File *dir, uint32_t nslots)
+{
+	struct DirIndex *di;
+	struct File *f;
+	uint32_t i, nentries;
+	char *blk;
+	int r;
+
+	if (dir->f_index == 0) {
+		if ((r = alloc_block()) < 0)
+			return r;
+		memset(diskaddr(r), 0, BLKSIZE);
+		dir->f_index = r;
+	}
+	di = diskaddr(dir->f_index);
+	di->di_magic = DIRINDEX_MAGIC;
+
+	// Start over with an empty table
+	file_set_size(&di->di_table, 0);
+	file_set_size(&di->di_table, nslots * 4);
+	for (i = 0; i < nslots * 4 / BLKSIZE; i++) {
+		if ((r = file_get_block(&di->di_table, i, &blk)) < 0)
+			return r;
+		memset(blk, 0, BLKSIZE);
+	}
+	di->di_nslots = nslots;
+	di->di_nused = di->di_ndeleted = 0;
+
+	nentries = dir->f_size / BLKSIZE * BLKFILES;
+	di->di_free = nentries;
+	for (i = 0; i < nentries; i++) {
+		if ((r = dir_entry(dir, i, &f)) < 0)
+			return r;
+		if (f->f_name[0] == '\0')
+			di->di_free = MIN(di->di_free, i);
+		else if ((r = dirindex_put(di, f->f_name, i)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+// Add entry number 'entry', just named 'name', to dir's index, first
+// building the index, or a bigger one once it is 3/4 full.
+static int
+dirindex_add(struct File *dir, const char *name, uint32_t entry)
+{
+	struct DirIndex *di;
+	uint32_t nslots;
+	int r;
+
+	di = dir->f_index ? diskaddr(dir->f_index) : NULL;
+	if (!di || (di->di_nused + di->di_ndeleted + 1) * 4 > di->di_nslots * 3) {
+		nslots = DIRINDEX_MINSLOTS;
+		while (nslots < (dir->f_size / BLKSIZE * BLKFILES) * 2)
+			nslots *= 2;
+		// The rebuild indexes this entry too
+		return dirindex_build(dir, nslots);
+	}
+	return dirindex_put(di, name, entry);
+}
+
+// Throw dir's index away, after it could not be brought up to date;
+// lookups scan the directory until dirindex_add builds a new one.
+static void
+dirindex_drop(struct File *dir)
+{
+	struct DirIndex *di;
+
+	if (dir->f_index == 0)
+		return;
+	di = diskaddr(dir->f_index);
+	file_set_size(&di->di_table, 0);
+	free_block(dir->f_index);
+	dir->f_index = 0;
+}
+
+// Take entry number 'entry', named 'name', out of dir's index.
+static int
+dirindex_remove(struct File *dir, const char *name, uint32_t entry)
+{
+	struct DirIndex *di;
+	uint32_t i, *slot;
+	int r;
+
+	if (dir->f_index == 0)
+		return 0;
+	di = diskaddr(dir->f_index);
+	for (i = dir_hash(name); ; i++) {
+		if ((r = dirindex_slot(di, i & (di->di_nslots - 1), &slot)) < 0)
+			return r;
+		if (*slot == 0)
+			return 0;
+		if (*slot == entry + 1)
+			break;
+	}
+	*slot = DIRINDEX_DELETED;
+	di->di_nused--;
+	di->di_ndeleted++;
+	di->di_free = MIN(di->di_free, entry);
+	return 0;
+}
+
+// Try to find a file named "name" in dir.  If so, set *file to it, and
+// *pentry to its entry number if pentry is not null.  Uses the
+// directory's index if it has one.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
 static int
-dir_lookup(struct File *dir, const char *name, struct File **file)
+dir_lookup(struct File *dir, const char *name, struct File **file,
+	   uint32_t *pentry)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, *slot;
+	struct DirIndex *di;
 	char *blk;
 	struct File *f;
 
@@ -227,6 +467,27 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+
+	if (dir->f_index) {
+		di = diskaddr(dir->f_index);
+		for (i = dir_hash(name); ; i++) {
+			if ((r = dirindex_slot(di, i & (di->di_nslots - 1), &slot)) < 0)
+				return r;
+			if (*slot == 0)
+				return -E_NOT_FOUND;
+			if (*slot == DIRINDEX_DELETED)
+				continue;
+			if ((r = dir_entry(dir, *slot - 1, &f)) < 0)
+				return r;
+			if (strcmp(f->f_name, name) == 0) {
+				*file = f;
+				if (pentry)
+					*pentry = *slot - 1;
+				return 0;
+			}
+		}
+	}
+
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
@@ -235,42 +496,127 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 		for (j = 0; j < BLKFILES; j++)
 			if (strcmp(f[j].f_name, name) == 0) {
 				*file = &f[j];
+				if (pentry)
+					*pentry = i * BLKFILES + j;
 				return 0;
 			}
 	}
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *pentry to
+// its entry number.  The caller is responsible for filling in the File
+// fields.  With an index, the search starts at its di_free.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pentry)
 {
 	int r;
 	uint32_t nblock, i, j;
+	struct DirIndex *di = NULL;
 	char *blk;
 	struct File *f;
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	i = 0;
+	if (dir->f_index) {
+		di = diskaddr(dir->f_index);
+		i = di->di_free / BLKFILES;
+	}
+	for (; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
 				*file = &f[j];
+				*pentry = i * BLKFILES + j;
+				if (di)
+					di->di_free = *pentry + 1;
 				return 0;
 			}
 	}
 	dir->f_size += BLKSIZE;
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
+	// The block may hold anything from an old file
+	memset(blk, 0, BLKSIZE);
 	f = (struct File*) blk;
 	*file = &f[0];
+	*pentry = i * BLKFILES;
+	if (di)
+		di->di_free = *pentry + 1;
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Name cache
+// --------------------------------------------------------------
+
+// Names recently looked up in each directory, and the File each one
+// named, or NULL if it wasn't there (a negative entry).  The cache is
+// direct-mapped.  File pointers stay good while the file exists, since
+// a File's address is fixed by the disk block holding it;
+// file_create and file_remove update the entries for names they change.
+#define NDCACHE		1024
+
+struct Dentry {
+	struct File *d_dir;		// NULL if unused
+	struct File *d_file;
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[NDCACHE];
+static uint32_t dcache_hits, dcache_misses;
+
+static struct Dentry *
+dcache_slot(struct File *dir, const char *name)
+{
+	// Files are 256-byte aligned
+	return &dcache[(dir_hash(name) ^ ((uintptr_t) dir >> 8)) % NDCACHE];
+}
+
+static void
+dcache_set(struct File *dir, const char *name, struct File *f)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+
+	d->d_dir = dir;
+	d->d_file = f;
+	strcpy(d->d_name, name);
+}
+
+// Like dir_lookup, but answer from the name cache when we can.
+static int
+dir_lookup_cached(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+	int r;
+
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0) {
+		dcache_hits++;
+		if (!d->d_file)
+			return -E_NOT_FOUND;
+		*file = d->d_file;
+		return 0;
+	}
+
+	dcache_misses++;
+	r = dir_lookup(dir, name, file, NULL);
+	if (r == 0)
+		dcache_set(dir, name, *file);
+	else if (r == -E_NOT_FOUND)
+		dcache_set(dir, name, NULL);
+	return r;
+}
+
+void
+dcache_stat(struct Fsret_cache *st)
+{
+	st->ret_dhits = dcache_hits;
+	st->ret_dmisses = dcache_misses;
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -318,7 +664,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dir_lookup_cached(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -347,18 +693,62 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t entry;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &entry)) < 0)
 		return r;
 
+	memset(f, 0, sizeof(*f));
 	strcpy(f->f_name, name);
+	if ((r = dirindex_add(dir, name, entry)) < 0) {
+		// Undo the entry.  The index may be half updated, and its
+		// di_free is past the entry, so stop trusting it.
+		f->f_name[0] = '\0';
+		dirindex_drop(dir);
+		flush_block(f);
+		flush_block(dir);
+		return r;
+	}
+	dcache_set(dir, name, f);
 	*pf = f;
-	file_flush(dir);
+	// The new entry, the directory's size and its index, which lookups
+	// trust, so a crash can't leave the file out of it; the rest goes
+	// with write-back.  (file_remove can leave the index to write-back:
+	// a stale slot only points at an entry whose name no longer matches.)
+	flush_block(f);
+	flush_block(dir);
+	if (dir->f_index)
+		file_flush(&((struct DirIndex *) diskaddr(dir->f_index))->di_table);
+	return 0;
+}
+
+// Remove the regular file "path", freeing its blocks.  The caller must
+// make sure it is not open.
+int
+file_remove(const char *path)
+{
+	int r;
+	uint32_t entry;
+	struct File *dir, *f;
+
+	if ((r = walk_path(path, &dir, &f, NULL)) < 0)
+		return r;
+	if (dir == 0 || f->f_type != FTYPE_REG)
+		return -E_INVAL;
+	if ((r = dir_lookup(dir, f->f_name, &f, &entry)) < 0)
+		return r;
+
+	if ((r = file_set_size(f, 0)) < 0
+	    || (r = dirindex_remove(dir, f->f_name, entry)) < 0)
+		return r;
+	dcache_set(dir, f->f_name, NULL);
+	memset(f, 0, sizeof(*f));
+	flush_block(f);
 	return 0;
 }
 
@@ -384,6 +774,8 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	file_prefetch(f, offset / BLKSIZE,
+		      (offset % BLKSIZE + count + BLKSIZE - 1) / BLKSIZE + FS_READAHEAD);
 
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
@@ -434,7 +826,9 @@ file_free_block(struct File *f, uint32_t filebno)
 	int r;
 	uint32_t *ptr;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) == -E_NOT_FOUND)
+		return 0;
+	if (r < 0)
 		return r;
 	if (*ptr) {
 		free_block(*ptr);
@@ -447,16 +841,17 @@ file_free_block(struct File *f, uint32_t filebno)
 // but not necessary for a file of size 'newsize'.
 // For both the old and new sizes, figure out the number of blocks required,
 // and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// Then free the indirect blocks that no longer map anything: the
+// indirect block if new_nblocks is no more than NDIRECT, and those
+// under the double-indirect block past the new end (and the
+// double-indirect block itself if it is left empty).
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
 	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, i, keep;
+	uint32_t *pind;
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
@@ -468,6 +863,22 @@ file_truncate_blocks(struct File *f, off_t newsize)
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
 	}
+
+	if (f->f_dindirect) {
+		keep = 0;	// indirect blocks still needed
+		if (new_nblocks > NDIRECT + NINDIRECT)
+			keep = ROUNDUP(new_nblocks - NDIRECT - NINDIRECT, NINDIRECT) / NINDIRECT;
+		pind = diskaddr(f->f_dindirect);
+		for (i = keep; i < NINDIRECT; i++)
+			if (pind[i]) {
+				free_block(pind[i]);
+				pind[i] = 0;
+			}
+		if (keep == 0) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
+	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
@@ -489,7 +900,7 @@ void
 file_flush(struct File *f)
 {
 	int i;
-	uint32_t *pdiskbno;
+	uint32_t *pdiskbno, *pind;
 
 	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
@@ -500,6 +911,13 @@ file_flush(struct File *f)
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (f->f_dindirect) {
+		pind = diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (pind[i])
+				flush_block(diskaddr(pind[i]));
+		flush_block(pind);
+	}
 }
 
 
@@ -507,8 +925,6 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	flush_blocks(1, super->s_nblocks - 1);
 }
 
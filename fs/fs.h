@@ -21,28 +21,52 @@ void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* Write-back: how often to look for dirty blocks, and the defaults
+ * for how long a block may stay dirty and what percentage of the
+ * cache may be dirty before it is all written back. */
+#define WB_INTERVAL	250	// ms
+#define WB_DIRTY_AGE	1000	// ms
+#define WB_DIRTY_RATIO	20	// percent
+
+/* Most blocks moved by one disk transfer (256 sectors) */
+#define BC_MAXRUN	32
+/* Blocks past the end of a read that file_read brings in as well */
+#define FS_READAHEAD	8
+
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	flush_blocks(uint32_t blockno, uint32_t n);
+void	bc_load(void *addr);
+void	bc_free(uint32_t blockno);
+void	bc_read_run(uint32_t blockno, uint32_t n);
+void	bc_lookup(void *addr);
+void	bc_set_limit(uint32_t nblocks);
+void	bc_set_writeback(uint32_t dirty_age, uint32_t dirty_ratio);
+int	bc_writeback(uint32_t now);
+void	bc_stat(struct Fsret_cache *st);
 void	bc_init(void);
 
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+void	file_prefetch(struct File *f, uint32_t file_blockno, uint32_t n);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
+void	dcache_stat(struct Fsret_cache *st);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
 
 /* test.c */
 void	fs_test(void);
@@ -134,17 +134,29 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	uint32_t i, n, *ind, *dind;
+
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
+	n = ROUNDUP(len, BLKSIZE) / BLKSIZE;
+	for (i = 0; i < n && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
+	if (i < n) {
+		ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < n && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i < n) {
+		dind = alloc(BLKSIZE);
+		f->f_dindirect = blockof(dind);
+		for (; i < n; ++i) {
+			if ((i - NDIRECT - NINDIRECT) % NINDIRECT == 0) {
+				ind = alloc(BLKSIZE);
+				dind[(i - NDIRECT - NINDIRECT) / NINDIRECT] = blockof(ind);
+			}
+			ind[(i - NDIRECT - NINDIRECT) % NINDIRECT] = start + i;
+		}
+	}
 }
 
 void
@@ -166,6 +178,36 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Build the hash index for the n entries at ents, numbered from 0,
+// for directory f
+void
+indexdir(struct File *f, struct File *ents, int n)
+{
+	struct DirIndex *di;
+	uint32_t nslots, i, *table;
+	int e;
+
+	nslots = DIRINDEX_MINSLOTS;
+	while (nslots < ROUNDUP(n, BLKFILES) * 2)
+		nslots *= 2;
+
+	di = alloc(BLKSIZE);
+	memset(di, 0, BLKSIZE);
+	di->di_magic = DIRINDEX_MAGIC;
+	di->di_nslots = nslots;
+	di->di_nused = n;
+	di->di_free = n;
+	table = alloc(nslots * 4);
+	memset(table, 0, nslots * 4);
+	for (e = 0; e < n; e++) {
+		for (i = dir_hash(ents[e].f_name); table[i & (nslots - 1)]; i++)
+			;
+		table[i & (nslots - 1)] = e + 1;
+	}
+	finishfile(&di->di_table, blockof(table), nslots * 4);
+	f->f_index = blockof(di);
+}
+
 void
 finishdir(struct Dir *d)
 {
@@ -173,6 +215,7 @@ finishdir(struct Dir *d)
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	indexdir(d->f, start, d->n);
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -228,7 +271,8 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	// The file server maps the disk in 3GB
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > 0xC0000000 / BLKSIZE)
 		usage();
 
 	opendisk(argv[1]);
@@ -5,6 +5,7 @@
 
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <inc/elf.h>
 
 #include "fs.h"
 
@@ -45,8 +46,19 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Virtual address at which to receive page mappings containing client
+// requests, with room for FSIPC_NPAGES pages.
+union Fsipc *fsreq = (union Fsipc *)0x0ffe0000;
+
+// Where serve_read_pages puts together the pages of its reply.
+#define READVA		((char *) 0x0ffc0000)
+
+// Where partial pages are filled in before being passed on.
+#define PAGEINVA	((char *) 0x0fffe000)
+
+// Where serve_pgfault fills in pages.  It can run from serve_reply while
+// a reply at PAGEINVA is still waiting to go out, so it needs its own.
+#define PGFAULTVA	((char *) 0x0fffd000)
 
 void
 serve_init(void)
@@ -150,11 +162,6 @@ try_open:
 			return r;
 		}
 	}
-	if ((r = file_open(path, &f)) < 0) {
-		if (debug)
-			cprintf("file_open failed: %e", r);
-		return r;
-	}
 
 	// Save the file pointer
 	o->o_file = f;
@@ -219,7 +226,9 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if ((r = file_read(o->o_file, (void *)ret, req->req_n, o->o_fd->fd_offset)) > 0) {
+	// The reply goes in the request page, which may be a ring slot
+	// with other requests right after it.
+	if ((r = file_read(o->o_file, (void *)ret, MIN(req->req_n, sizeof(ret->ret_buf)), o->o_fd->fd_offset)) > 0) {
         o->o_fd->fd_offset += r; 
     }
 
@@ -244,7 +253,7 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-    if ((r = file_write(o->o_file, (void *)req->req_buf, req->req_n, o->o_fd->fd_offset)) > 0) {
+    if ((r = file_write(o->o_file, (void *)req->req_buf, MIN(req->req_n, sizeof(req->req_buf)), o->o_fd->fd_offset)) > 0) {
         o->o_fd->fd_offset += r; 
     }
 
@@ -290,6 +299,148 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 }
 
 
+// Map the page of req_fileid at req_offset, which must be page-aligned,
+// read-only into the caller: the block cache's own page, or, for a
+// partial last block, a copy zeroed past the end of the file.  Returns
+// the number of bytes of file data in the page, 0 past the end.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, void **pg_store,
+	  int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int n, r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE)
+		return -E_INVAL;
+	if (req->req_offset >= o->o_file->f_size)
+		return 0;
+
+	n = MIN(o->o_file->f_size - req->req_offset, BLKSIZE);
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+	bc_load(blk);
+	if (n < BLKSIZE) {
+		if ((r = sys_page_alloc(0, PAGEINVA, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		memmove(PAGEINVA, blk, n);
+	} else {
+		// The extra mapping keeps bc_evict off the page until the
+		// reply is out, even if serve_reply pages something in.
+		if ((r = sys_page_map(0, blk, 0, PAGEINVA, PTE_P|PTE_U)) < 0)
+			return r;
+	}
+
+	*pg_store = PAGEINVA;
+	*perm_store = PTE_P|PTE_U;
+	return n;
+}
+
+// Read up to req->req_n bytes, at most FSIPC_NPAGES pages' worth, from
+// the current seek position in req->req_fileid, and return them in
+// pages for the caller to map read-only.  From a block-aligned
+// position those are the block cache's own pages, so nothing is copied
+// here.  Updates the seek position; returns the number of bytes read.
+int
+serve_read_pages(envid_t envid, struct Fsreq_read *req, void **pg_store,
+		 int *npages_store, int *perm_store)
+{
+	struct PageMapBatch batch;
+	struct OpenFile *o;
+	off_t off;
+	size_t n;
+	char *blk;
+	int i, npages, r;
+
+	if (debug)
+		cprintf("serve_read_pages %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	off = o->o_fd->fd_offset;
+	if (off >= o->o_file->f_size)
+		return 0;
+	n = MIN(MIN(req->req_n, FSIPC_NPAGES * PGSIZE), o->o_file->f_size - off);
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+
+	file_prefetch(o->o_file, off / BLKSIZE, npages + 1 + FS_READAHEAD);
+	if (off % BLKSIZE == 0) {
+		pagemap_init(&batch);
+		for (i = 0; i < npages; i++) {
+			if ((r = file_get_block(o->o_file, off / BLKSIZE + i, &blk)) < 0)
+				return r;
+			bc_load(blk);
+			if ((r = pagemap_add(&batch, 0, blk, 0, READVA + i * PGSIZE,
+					     PTE_P|PTE_U)) < 0)
+				return r;
+		}
+		if ((r = pagemap_flush(&batch)) < 0)
+			return r;
+	} else {
+		for (i = 0; i < npages; i++)
+			if ((r = sys_page_alloc(0, READVA + i * PGSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				return r;
+		if ((r = file_read(o->o_file, READVA, n, off)) < 0)
+			return r;
+	}
+
+	o->o_fd->fd_offset += n;
+	*pg_store = READVA;
+	*npages_store = npages;
+	*perm_store = PTE_P|PTE_U;
+	return n;
+}
+
+// Write req->req_n bytes from req->req_buf, which came in npages
+// pages, as serve_write does.
+int
+serve_write_pages(envid_t envid, struct Fsreq_write_pages *req, int npages)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_pages %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if (req->req_n > npages * PGSIZE - offsetof(struct Fsreq_write_pages, req_buf))
+		return -E_INVAL;
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	if ((r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) > 0)
+		o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Remove the file named req->req_path.  An OpenFile points at the
+// file's directory entry, so open files can't be removed.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+	struct File *f;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	if ((r = file_open(path, &f)) < 0)
+		return r;
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == f && pageref(opentab[i].o_fd) > 1)
+			return -E_INVAL;
+	return file_remove(path);
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
@@ -297,6 +448,116 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Report block cache statistics, first changing any of the cache
+// settings that the request gives.
+int
+serve_cache(envid_t envid, union Fsipc *req)
+{
+	struct Fsreq_cache creq = req->cache;
+
+	if (creq.req_limit)
+		bc_set_limit(creq.req_limit);
+	bc_set_writeback(creq.req_dirty_age, creq.req_dirty_ratio);
+	bc_stat(&req->cacheRet);
+	dcache_stat(&req->cacheRet);
+	return 0;
+}
+
+// Page in the program of envid, whose pager we are, at va.  spawn
+// left the program's file ID in env_pager_arg; the ELF program headers
+// say what belongs at va.  Mapping the page resumes envid; if that
+// fails, destroy it.
+static void
+serve_pgfault(envid_t envid, uintptr_t va)
+{
+	struct OpenFile *o;
+	struct Elf *elf;
+	struct Proghdr *ph;
+	char *blk;
+	uint32_t pageoff, foff;
+	int i, n, m, perm, r;
+
+	if (debug)
+		cprintf("serve_pgfault %08x %08x\n", envid, va);
+
+	if ((r = openfile_lookup(envid, envs[ENVX(envid)].env_pager_arg, &o)) < 0
+	    || (r = file_get_block(o->o_file, 0, &blk)) < 0)
+		goto fail;
+
+	r = -E_NOT_EXEC;
+	elf = (struct Elf *) blk;
+	if (elf->e_magic != ELF_MAGIC
+	    || elf->e_phoff + elf->e_phnum * sizeof(*ph) > BLKSIZE)
+		goto fail;
+	ph = (struct Proghdr *) (blk + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++, ph++)
+		if (ph->p_type == ELF_PROG_LOAD
+		    && va >= ROUNDDOWN(ph->p_va, PGSIZE)
+		    && va < ph->p_va + ph->p_memsz)
+			break;
+	if (i == elf->e_phnum || PGOFF(ph->p_offset) != PGOFF(ph->p_va))
+		goto fail;
+
+	// As in spawn, the page's file data (if any) is at the same page
+	// offset in the file as the page is in the segment.
+	pageoff = va - ROUNDDOWN(ph->p_va, PGSIZE);
+	foff = ROUNDDOWN(ph->p_offset, PGSIZE) + pageoff;
+	n = MIN((int) (PGOFF(ph->p_va) + ph->p_filesz - pageoff), PGSIZE);
+	m = MIN((int) (PGOFF(ph->p_va) + ph->p_memsz - pageoff), PGSIZE);
+	perm = PTE_P | PTE_U;
+	if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+		perm |= PTE_W;
+
+	if (n <= 0) {
+		r = sys_page_alloc(envid, (void *) va, (perm & PTE_W) ?
+				   (perm & ~PTE_W) | PTE_COW : perm);
+	} else if (foff + n > o->o_file->f_size) {
+		r = -E_NOT_EXEC;
+	} else if (!(perm & PTE_W) && m <= n) {
+		// Read-only, and nothing in the page needs zeroing: hand out
+		// the block cache's own page, so that every instance of the
+		// program shares one copy of its text.
+		if ((r = file_get_block(o->o_file, foff / BLKSIZE, &blk)) == 0) {
+			bc_load(blk);
+			r = sys_page_map(0, blk, envid, (void *) va, perm);
+		}
+	} else if ((r = sys_page_alloc(0, PGFAULTVA, PTE_P|PTE_U|PTE_W)) == 0) {
+		if ((r = file_get_block(o->o_file, foff / BLKSIZE, &blk)) == 0) {
+			memmove(PGFAULTVA, blk, n);
+			r = sys_page_map(0, PGFAULTVA, envid, (void *) va, perm);
+		}
+		sys_page_unmap(0, PGFAULTVA);
+	}
+	if (r == 0)
+		return;
+
+fail:
+	cprintf("[%08x] cannot page in %08x: %e\n", envid, va, r);
+	sys_env_destroy(envid);
+}
+
+// Send a reply to whom.  Meanwhile, if whom is stuck on a fault for
+// which we are the pager, page it in: the kernel only passes faults on
+// while we wait in ipc_recv, so otherwise neither of us would move.
+static void
+serve_reply(envid_t whom, int r, void *pg, int npages, int perm)
+{
+	const volatile struct Env *e = &envs[ENVX(whom)];
+	uintptr_t va;
+	int err;
+
+	if (!pg)
+		pg = (void *) UTOP;
+	while ((err = sys_ipc_try_send_pages(whom, r, pg, npages, perm))
+	       == -E_IPC_NOT_RECV) {
+		if (e->env_pager == thisenv->env_id && (va = e->env_pager_va))
+			serve_pgfault(whom, va);
+		sys_yield();
+	}
+	if (err < 0)
+		panic("serve_reply: sys_ipc_try_send, %e", err);
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -307,24 +568,161 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_CACHE] =		serve_cache
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Request rings registered by clients, each mapped at its own
+// FSIPC_NPAGES pages from RINGVA on.
+#define MAXRINGS	32
+#define RINGVA		0x0f000000
+
+struct RingClient {
+	envid_t rc_envid;	// 0 if unused
+	struct Fsring *rc_ring;
+};
+
+struct RingClient ringtab[MAXRINGS];
+
+static void
+ring_free(struct RingClient *rc)
+{
+	int i;
+
+	for (i = 0; i < FSIPC_NPAGES; i++)
+		sys_page_unmap(0, (char *) rc->rc_ring + i * PGSIZE);
+	rc->rc_envid = 0;
+}
+
+// Take the npages pages at fsreq as envid's request ring, in place of
+// any it had before.
+int
+serve_ring_setup(envid_t envid, int npages)
+{
+	struct RingClient *rc = NULL;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_ring_setup %08x\n", envid);
+
+	if (npages != FSIPC_NPAGES)
+		return -E_INVAL;
+	for (i = 0; i < MAXRINGS; i++) {
+		if (ringtab[i].rc_envid == envid)
+			ring_free(&ringtab[i]);
+		if (ringtab[i].rc_envid == 0 && !rc)
+			rc = &ringtab[i];
+	}
+	if (!rc)
+		return -E_MAX_OPEN;
+
+	rc->rc_ring = (struct Fsring *) (RINGVA + (rc - ringtab) * FSIPC_NPAGES * PGSIZE);
+	for (i = 0; i < FSIPC_NPAGES; i++)
+		if ((r = sys_page_map(0, (char *) fsreq + i * PGSIZE,
+				      0, (char *) rc->rc_ring + i * PGSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0) {
+			ring_free(rc);
+			return r;
+		}
+	rc->rc_envid = envid;
+	return 0;
+}
+
+// Run the requests queued on each ring, at most a ring's worth per
+// client so no one can keep us here, and drop the rings of clients
+// that have gone away.  Returns the number of requests run.
+static int
+ring_poll(void)
+{
+	struct RingClient *rc;
+	struct Fsring *ring;
+	struct Fsring_sqe sqe;
+	struct Fsring_cqe *cqe;
+	uint32_t head;
+	int i, n, r;
+
+	n = 0;
+	for (rc = ringtab; rc < ringtab + MAXRINGS; rc++) {
+		if (rc->rc_envid == 0)
+			continue;
+		ring = rc->rc_ring;
+		if (pageref(ring) <= 1) {
+			ring_free(rc);
+			continue;
+		}
+
+		for (i = 0; i < FSRING_NENT && (head = ring->r_sq_head) != ring->r_sq_tail; i++) {
+			sqe = ring->r_sq[head % FSRING_NENT];
+			if (sqe.sqe_slot >= FSRING_NSLOTS)
+				r = -E_INVAL;
+			else if (sqe.sqe_type < NHANDLERS && handlers[sqe.sqe_type])
+				r = handlers[sqe.sqe_type](rc->rc_envid,
+					(union Fsipc *) ((char *) ring + (sqe.sqe_slot + 1) * PGSIZE));
+			else
+				r = -E_INVAL;
+
+			cqe = &ring->r_cq[ring->r_cq_tail % FSRING_NENT];
+			cqe->cqe_slot = sqe.sqe_slot;
+			cqe->cqe_res = r;
+			cqe->cqe_data = sqe.sqe_data;
+			__sync_synchronize();
+			ring->r_cq_tail++;
+			ring->r_sq_head = head + 1;
+			n++;
+		}
+	}
+	return n;
+}
+
+// Tell every ring client whether we need a kick to notice new requests.
+static void
+ring_set_flags(uint32_t flags)
+{
+	int i;
+
+	for (i = 0; i < MAXRINGS; i++)
+		if (ringtab[i].rc_envid)
+			ringtab[i].rc_ring->r_flags = flags;
+	__sync_synchronize();
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
+	int perm, npages, nreply, r;
 	void *pg;
 
 	while (1) {
+		bc_writeback(sys_time_msec());
+
+		// One pass over the rings between IPC requests, so busy rings
+		// can't keep IPC clients waiting; then ask for kicks, and look
+		// again for requests that came in before the ask was seen.
+		// Anything later comes with a kick.
+		ring_poll();
+		ring_set_flags(FSRING_NEED_WAKEUP);
+		ring_poll();
+
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		npages = FSIPC_NPAGES;
+		req = ipc_recv_pages((int32_t *) &whom, fsreq, &npages, &perm);
+		ring_set_flags(0);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		if (req == FSREQ_RING_KICK || req == FSREQ_WRITEBACK)
+			continue;
+
+		// Faults by envs we page in for (see spawn) come without one
+		if (PGOFF(req) == IPC_PGFAULT) {
+			serve_pgfault(whom, PTE_ADDR(req));
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
@@ -333,22 +731,51 @@ serve(void)
 		}
 
 		pg = NULL;
+		nreply = 1;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, &fsreq->map, &pg, &perm);
+		} else if (req == FSREQ_READ_PAGES) {
+			r = serve_read_pages(whom, &fsreq->read, &pg, &nreply, &perm);
+		} else if (req == FSREQ_WRITE_PAGES) {
+			r = serve_write_pages(whom, (struct Fsreq_write_pages *)fsreq, npages);
+		} else if (req == FSREQ_RING_SETUP) {
+			r = serve_ring_setup(whom, npages);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		serve_reply(whom, r, pg, nreply, perm);
+		while (npages-- > 0)
+			sys_page_unmap(0, (char *) fsreq + npages * PGSIZE);
+		if (pg == PAGEINVA)
+			sys_page_unmap(0, PAGEINVA);
+		else if (pg == READVA)
+			while (nreply-- > 0)
+				sys_page_unmap(0, READVA + nreply * PGSIZE);
+	}
+}
+
+// Nudge the file server every WB_INTERVAL ms, so that it writes back
+// dirty blocks even while no requests come in to wake it.
+static void
+writeback_timer(envid_t fsenv)
+{
+	binaryname = "fs_wbtimer";
+	while (1) {
+		sys_sleep(WB_INTERVAL);
+		ipc_send(fsenv, FSREQ_WRITEBACK, 0, 0);
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	envid_t timer;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
@@ -357,6 +784,14 @@ umain(int argc, char **argv)
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
+	// Start the timer before the block cache fills, so fork has little
+	// to copy.
+	if ((timer = fork()) < 0)
+		panic("fork: %e", timer);
+	if (timer == 0)
+		writeback_timer(thisenv->env_parent_id);
+	sys_env_set_priority(timer, ENV_PRIO_BACKGROUND);
+
 	serve_init();
 	fs_init();
 	serve();
@@ -38,6 +38,16 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priorities.  Runnable envs at a lower value run before
+// those at a higher one, except that envs passed over for too long
+// are aged to the front (see kern/sched.c).
+enum {
+	ENV_PRIO_SERVER = 0,	// System servers (file system, network)
+	ENV_PRIO_NORMAL,	// Default for user environments
+	ENV_PRIO_BACKGROUND,	// Batch work that yields to everything else
+	NENVPRIO
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -45,6 +55,13 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// A pager learns of a fault by an IPC from the faulting env, carrying
+// no page, whose value is the page's address or'ed with IPC_PGFAULT.
+#define IPC_PGFAULT	0xFFF
+
+// Most pages that one IPC can carry.
+#define IPC_MAXPAGES	32
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -55,18 +72,38 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	int env_priority;		// Scheduling priority (ENV_PRIO_*)
+	uint32_t env_rq_stamp;		// Run queue clock when last queued
+	struct Env *env_rq_next;	// Next env on the same run queue
+	struct Env *env_rq_prev;	// Previous env on the same run queue
+	int env_rq_cpu;			// CPU whose run queue holds the env, or -1
+	uint32_t env_wakeup;		// time_msec() to end sys_sleep at, or 0
+	struct Env *env_sleep_next;	// Next env on the sleep queue
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	envid_t env_vmid;		// env_id of the env that created it
+	bool env_vmshared;		// Page tables shared with threads
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
+	// Demand paging (see sys_env_set_pager)
+	envid_t env_pager;		// Env that fills in missing pages, or 0
+	uintptr_t env_pager_start;	// ... for faults in [start, end)
+	uintptr_t env_pager_end;
+	uint32_t env_pager_arg;		// For the pager's use
+	uintptr_t env_pager_va;		// Page awaited from the pager, or 0
+
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	int env_ipc_npages_max;		// Pages we'll take at env_ipc_dstva
+	int env_ipc_npages;		// Pages received there
 };
 
 #endif // !JOS_INC_ENV_H
@@ -23,8 +23,11 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks reached through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// The block pointers reach 4GB; off_t is what stops us
+#define MAXFILESIZE	0x7FFFF000
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -35,10 +38,12 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// block of indirect blocks
+	uint32_t f_index;		// directories: DirIndex block, or 0
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - 4 - 4];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,6 +53,35 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// A directory's hash index, found through its f_index.  di_table is an
+// unnamed file of di_nslots hash slots, open-addressed with linear
+// probing from dir_hash(name).  A slot holds 0 if it is empty,
+// DIRINDEX_DELETED if its entry was removed, or else 1 + the entry's
+// number in the directory (its block times BLKFILES plus its index).
+struct DirIndex {
+	uint32_t di_magic;		// DIRINDEX_MAGIC
+	uint32_t di_nslots;		// a power of two
+	uint32_t di_nused;		// slots holding entries
+	uint32_t di_ndeleted;		// DIRINDEX_DELETED slots
+	uint32_t di_free;		// every entry before this is in use
+	struct File di_table;
+};
+
+#define DIRINDEX_MAGIC		0x58444944	// 'DIDX'
+#define DIRINDEX_DELETED	0xFFFFFFFF
+#define DIRINDEX_MINSLOTS	(BLKSIZE / 4)
+
+// FNV-1a
+static inline uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 
 // File system super-block (both in-memory and on-disk)
 
@@ -70,9 +104,25 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns a page of the file, read-only, instead of a copy
+	FSREQ_MAP,
+	// Multi-page read and write, moving up to FSIPC_NPAGES pages of
+	// data per IPC.  Read pages come back mapped read-only.
+	FSREQ_READ_PAGES,
+	FSREQ_WRITE_PAGES,
+	// Register a request ring (struct Fsring), sent as FSIPC_NPAGES pages
+	FSREQ_RING_SETUP,
+	// Sent with no page and no reply: look at the rings again
+	FSREQ_RING_KICK,
+	// Cache returns a Fsret_cache on the request page
+	FSREQ_CACHE,
+	// Sent with no page and no reply by the file server's timer
+	FSREQ_WRITEBACK
 };
 
+#define FSIPC_NPAGES	16
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -108,9 +158,75 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	// In Fsreq_cache, 0 leaves a setting unchanged
+	struct Fsreq_cache {
+		uint32_t req_limit;	// most blocks kept in memory
+		uint32_t req_dirty_age;	// ms a block may stay dirty
+		uint32_t req_dirty_ratio;	// percent of the cache that may
+	} cache;
+	struct Fsret_cache {
+		uint32_t ret_hits;	// block lookups found in memory
+		uint32_t ret_misses;	// blocks read in from disk
+		uint32_t ret_reads;	// disk transfers that took
+		uint32_t ret_evictions;	// blocks dropped to stay under the limit
+		uint32_t ret_writebacks;	// dirty blocks written to disk
+		uint32_t ret_resident;	// blocks in memory now
+		uint32_t ret_dirty;	// dirty blocks, as of the last write-back
+		uint32_t ret_limit;
+		uint32_t ret_dirty_age;
+		uint32_t ret_dirty_ratio;
+		uint32_t ret_dhits;	// path components found in the name cache
+		uint32_t ret_dmisses;	// and looked up in the directory
+	} cacheRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
 };
 
+// FSREQ_WRITE_PAGES sends this, up to FSIPC_NPAGES pages long, in
+// place of a union Fsipc.  (FSREQ_READ_PAGES takes a Fsreq_read.)
+struct Fsreq_write_pages {
+	int req_fileid;
+	size_t req_n;
+	char req_buf[FSIPC_NPAGES * PGSIZE - (sizeof(int) + sizeof(size_t))];
+};
+
+// A request ring shared between a client and the file server, in the
+// style of io_uring.  It takes FSIPC_NPAGES pages: this header, then
+// one union Fsipc page per slot.  The client fills in a slot, puts
+// a Fsring_sqe naming it on the submission queue and bumps sq_tail;
+// the server takes requests from sq_head on and answers each with a
+// Fsring_cqe, leaving any reply in the slot.  Only requests that need
+// no page passed (read, write, stat, flush, set_size, sync) can be
+// queued.  While FSRING_NEED_WAKEUP is set the server is asleep and
+// must be sent FSREQ_RING_KICK after new submissions.
+#define FSRING_NSLOTS	(FSIPC_NPAGES - 1)
+#define FSRING_NENT	16	// power of two, > FSRING_NSLOTS
+
+#define FSRING_NEED_WAKEUP	0x1
+
+struct Fsring_sqe {
+	uint32_t sqe_type;		// FSREQ_*
+	uint32_t sqe_slot;		// request and reply page
+	uint32_t sqe_data;		// passed back in the completion
+};
+
+struct Fsring_cqe {
+	uint32_t cqe_slot;
+	int32_t cqe_res;		// what the request returned
+	uint32_t cqe_data;
+};
+
+struct Fsring {
+	volatile uint32_t r_flags;
+	volatile uint32_t r_sq_head, r_sq_tail;
+	volatile uint32_t r_cq_head, r_cq_tail;
+	struct Fsring_sqe r_sq[FSRING_NENT];
+	struct Fsring_cqe r_cq[FSRING_NENT];
+};
+
 #endif /* !JOS_INC_FS_H */
@@ -30,10 +30,22 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
+// Our own Env.  The kernel points %gs at it, so that each of several
+// threads sharing an address space (see sfork) finds its own.
+static inline const volatile struct Env *
+thisenv_get(void)
+{
+	envid_t id;
+
+	asm volatile("movl %%gs:%c1,%0"
+		     : "=r" (id) : "i" (offsetof(struct Env, env_id)));
+	return &envs[ENVX(id)];
+}
+#define thisenv	(thisenv_get())
+
 // exit.c
 void	exit(void);
 
@@ -51,15 +63,24 @@ int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_priority(envid_t env, int priority);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_pager(envid_t env, envid_t pager, uintptr_t start,
+			  uintptr_t end, uint32_t arg);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_map_batch(const struct PageMapOp *ops, int n);
+envid_t	sys_fork(void);
+envid_t	sys_sfork(void);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg, int npages, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_pages(void *rcv_pg, int npages);
 unsigned int sys_time_msec(void);
+int	sys_sleep(unsigned int msec);
 int sys_net_try_send(void *data, size_t len);
 int sys_net_try_receive(void *data, size_t *plen);
 
@@ -78,13 +99,15 @@ sys_exofork(void)
 
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, int npages, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, int *npages, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	ufork(void);
+envid_t	sfork(void);
 
 // fd.c
 int	close(int fd);
@@ -102,10 +125,32 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fscache(const struct Fsreq_cache *set, struct Fsret_cache *st);
+ssize_t	fmap(int fd, void *va, size_t len, off_t offset);
+void	funmap(void *va, size_t len);
+
+// fsring.c
+int	fsring_init(void);
+int	fsring_prep(unsigned type, int fd, uint32_t data, union Fsipc **req);
+int	fsring_submit(void);
+int	fsring_wait(struct Fsring_cqe *cqe, union Fsipc **reply);
+void	fsring_seen(struct Fsring_cqe *cqe);
 
 // pageref.c
 int	pageref(void *addr);
 
+// pagemap.c
+#define PAGEMAP_BATCH	32
+struct PageMapBatch {
+	struct PageMapOp pb_ops[PAGEMAP_BATCH];
+	int pb_n;
+};
+void	pagemap_init(struct PageMapBatch *b);
+int	pagemap_add(struct PageMapBatch *b, envid_t srcenv, void *srcva,
+		    envid_t dstenv, void *dstva, int perm);
+int	pagemap_unmap(struct PageMapBatch *b, envid_t env, void *va);
+int	pagemap_flush(struct PageMapBatch *b);
+
 // sockets.c
 int     accept(int s, struct sockaddr *addr, socklen_t *addrlen);
 int     bind(int s, struct sockaddr *name, socklen_t namelen);
@@ -126,6 +171,7 @@ int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
 
 // spawn.c
+extern bool spawn_lazy;
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
 
@@ -178,6 +178,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous page on a buddy free list (see kern/pmap.c).
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,6 +187,10 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// If this page heads a free buddy block, log2 of the block's
+	// size in pages; otherwise -1.
+	int16_t pp_order;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/env.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -20,7 +22,23 @@ enum {
 	SYS_time_msec,
     SYS_net_try_send,
     SYS_net_try_receive,
+	SYS_env_set_priority,
+	SYS_page_map_batch,
+	SYS_fork,
+	SYS_sfork,
+	SYS_env_set_pager,
+	SYS_sleep,
 	NSYSCALLS
 };
 
+// One operation for SYS_page_map_batch, with the arguments of
+// sys_page_map.  With pm_perm 0, it unmaps pm_dstva in pm_dstenv.
+struct PageMapOp {
+	envid_t pm_srcenv;
+	void *pm_srcva;
+	envid_t pm_dstenv;
+	void *pm_dstva;
+	int pm_perm;
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -293,4 +293,14 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add 'v' to *addr, returning the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t v)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (v), "+m" (*addr) :
+			: "memory", "cc");
+	return v;
+}
+
 #endif /* !JOS_INC_X86_H */
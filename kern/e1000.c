@@ -1,20 +1,26 @@
 #include <kern/e1000.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
 #include <inc/assert.h>
 #include <inc/string.h>
 
 // LAB 6: Your driver code here
 volatile uint32_t *eth_loc;
 
-struct tx_desc tx_queue[E1000_TDLEN_MAX];
-struct rx_desc rx_queue[E1000_RCV_MAX];
+// Descriptor rings and packet buffers, in physically contiguous memory
+// from page_alloc_order (see attach_e1000).
+struct tx_desc *tx_queue;
+struct rx_desc *rx_queue;
 
-char tx_buffer[E1000_TDLEN_MAX][2048];
-char rx_buffer[E1000_RCV_MAX][2048];
+char (*tx_buffer)[E1000_BUF_SIZE];
+char (*rx_buffer)[E1000_BUF_SIZE];
 
 char *packet_test = "hello packet.hello packet.hello packet.hello packet.";
 
+// Serializes access to the descriptor rings and TDT/RDT registers.
+static struct spinlock e1000_lock = SPINLOCK_INIT(e1000_lock);
+
 static void
 ethw(int index, int value) {
     eth_loc[index >> INTSHIFT] = value;
@@ -60,6 +66,21 @@ convert(void *addr) {
     return page2pa(&pages[PGNUM(*pte)]) + offset;
 }
 
+/**
+ * allocate size bytes of zeroed, physically contiguous memory
+ */
+static void *
+contig_alloc(size_t size) {
+    int order = 0;
+    while ((PGSIZE << order) < size)
+        order++;
+
+    struct PageInfo *pp = page_alloc_order(order, ALLOC_ZERO);
+    if (!pp)
+        panic("e1000: out of contiguous memory");
+    return page2kva(pp);
+}
+
 int mac_addr(int index) {
     if (EEPROM_MAC_ADDR1 <= index && index <= EEPROM_MAC_ADDR3)
         return eerd(index);
@@ -72,6 +93,7 @@ int mac_addr(int index) {
  * return 0 if success else -1
  */
 int e1000_transmit(void *addr, uint16_t len) {
+    spin_lock(&e1000_lock);
     uint32_t tail = ethr(E1000_TDT);
     uint32_t next_index = (tail + 1 < E1000_TDLEN_MAX) ? 
         (tail + 1) : 0;
@@ -79,8 +101,10 @@ int e1000_transmit(void *addr, uint16_t len) {
     assert(next_index < E1000_TDLEN_MAX);
 
     // ignore 
-    if (check_transmit_ready(tail) == 0)
+    if (check_transmit_ready(tail) == 0) {
+        spin_unlock(&e1000_lock);
         return -1;
+    }
 
     memmove(tx_buffer[tail], addr, len);
     tx_queue[tail].addr = PADDR(tx_buffer[tail]);
@@ -89,15 +113,18 @@ int e1000_transmit(void *addr, uint16_t len) {
     tx_queue[tail].status = 0;
 
     ethw(E1000_TDT, next_index);
+    spin_unlock(&e1000_lock);
     return 0;
 }
 
 int e1000_receive(void *addr, uint32_t *len) {
+    spin_lock(&e1000_lock);
     int i = ethr(E1000_RDT);
     int last = (i == E1000_RCV_MAX - 1) ? (0) : (i + 1);
     int r = check_rcv_ready(last);
     if (r == 0) {
         //ethw(E1000_RDT, next);
+        spin_unlock(&e1000_lock);
         return -1;
     } 
 
@@ -106,6 +133,7 @@ int e1000_receive(void *addr, uint32_t *len) {
 
     rx_queue[last].status = 0;
     ethw(E1000_RDT, last);
+    spin_unlock(&e1000_lock);
 
     //cprintf("===== tail = %d\n", last);
     return 0;
@@ -122,6 +150,11 @@ int attach_e1000(struct pci_func *func) {
     uint32_t reg = ethr(E1000_STATUS);
     cprintf("PCI status register %x\n", reg);
 
+    tx_queue = contig_alloc(E1000_TDLEN_MAX * sizeof(struct tx_desc));
+    rx_queue = contig_alloc(E1000_RCV_MAX * sizeof(struct rx_desc));
+    tx_buffer = contig_alloc(E1000_TDLEN_MAX * sizeof(*tx_buffer));
+    rx_buffer = contig_alloc(E1000_RCV_MAX * sizeof(*rx_buffer));
+
     
     // set TDBAL to the pa of tx queue
     assert((PADDR(tx_queue) & 7) == 0);
@@ -7,6 +7,7 @@
 #define INTSHIFT    2
 #define E1000_TDLEN_MAX 64
 #define E1000_RCV_MAX   256
+#define E1000_BUF_SIZE  2048    // bytes in each packet buffer
 
 /* Register Set. (82543, 82544)
  *
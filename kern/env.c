@@ -18,6 +18,7 @@
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_locks[NENV];	// Per-env locks (see env_lock)
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -36,7 +37,7 @@ static struct Env *env_free_list;	// Free environment list
 // definition of gdt specifies the Descriptor Privilege Level (DPL)
 // of that descriptor: 0 for kernel and 3 for user.
 //
-struct Segdesc gdt[NCPU + 5] =
+struct Segdesc gdt[2 * NCPU + 5] =
 {
 	// 0x0 - unused (always faults -- for trapping NULL far pointers)
 	SEG_NULL,
@@ -55,7 +56,11 @@ struct Segdesc gdt[NCPU + 5] =
 
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
-	[GD_TSS0 >> 3] = SEG_NULL
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU user env segments (starting from GD_UENV0) are set
+	// in env_run()
+	[GD_UENV0 >> 3] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -67,6 +72,9 @@ struct Pseudodesc gdt_pd = {
 // If checkperm is set, the specified environment must be either the
 // current environment or an immediate child of the current environment.
 //
+// The caller must hold env_table_lock for the returned env to stay valid,
+// unless envid refers to the current environment.
+//
 // RETURNS
 //   0 on success, -E_BAD_ENV on error.
 //   On success, sets *env_store to the environment.
@@ -125,14 +133,88 @@ env_init(void)
 	// LAB 3: Your code here.
     for (int i=NENV-1; i>=0; i--) {
         envs[i].env_id = 0;
+        envs[i].env_rq_cpu = -1;
         envs[i].env_link = env_free_list;
         env_free_list = &envs[i];
+        __spin_initlock(&env_locks[i], "env_lock");
     }
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
 
+// Lock e's address space and IPC receive state.  Anything that edits
+// e->env_pgdir or e's env_ipc_* fields must hold this lock, so that
+// e can't be freed or reused underneath it.  Threads share page tables,
+// so they share the lock of the env that created the address space.
+// (Once that env's slot is reused, its new tenant shares the lock too,
+// which is safe, just coarser.)
+void
+env_lock(struct Env *e)
+{
+    spin_lock(&env_locks[ENVX(e->env_vmid)]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+    spin_unlock(&env_locks[ENVX(e->env_vmid)]);
+}
+
+// Lock two envs, which may be the same or share a lock, in lock order.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+    if (ENVX(a->env_vmid) > ENVX(b->env_vmid)) {
+        struct Env *t = a;
+        a = b;
+        b = t;
+    }
+    env_lock(a);
+    if (ENVX(b->env_vmid) != ENVX(a->env_vmid))
+        env_lock(b);
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+    env_unlock(a);
+    if (ENVX(b->env_vmid) != ENVX(a->env_vmid))
+        env_unlock(b);
+}
+
+// e's page directory entry for va was just changed: a page table was
+// created, or a 4MB page mapped or unmapped.  Copy the entry to the
+// threads sharing e's address space.  The caller holds env_lock(e).
+void
+env_vm_sync(struct Env *e, void *va)
+{
+    uint32_t pdx = PDX(va);
+    pde_t pde = e->env_pgdir[pdx], old;
+    struct Env *s;
+
+    if (!e->env_vmshared || pdx == ENV_PRIVATE_PDX)
+        return;
+
+    for (s = envs; s < envs + NENV; s++) {
+        if (s == e || s->env_vmid != e->env_vmid || !s->env_pgdir
+                || s->env_status == ENV_FREE || s->env_pgdir[pdx] == pde)
+            continue;
+        if (pde & PTE_P) {
+            spin_lock(&page_lock);
+            pa2page(PTE_ADDR(pde))->pp_ref++;
+            spin_unlock(&page_lock);
+        }
+        old = s->env_pgdir[pdx];
+        s->env_pgdir[pdx] = pde;
+        tlb_invalidate(s->env_pgdir, va);
+        // Drop s's reference to the old page table or 4MB page.
+        if (old & PTE_P)
+            page_decref_order(pa2page(PTE_ADDR(old)),
+                              (old & PTE_PS) ? PAGE_LARGE_ORDER : 0);
+    }
+}
+
 // Load GDT and segment descriptors.
 void
 env_init_percpu(void)
@@ -208,6 +290,8 @@ env_setup_vm(struct Env *e)
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// The new environment is ENV_NOT_RUNNABLE; the caller makes it runnable
+// once it is fully set up.  The caller must hold env_table_lock.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
@@ -232,12 +316,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	if (generation <= 0)	// Don't create a negative env_id.
 		generation = 1 << ENVGENSHIFT;
 	e->env_id = generation | (e - envs);
+	e->env_vmid = e->env_id;
+	e->env_vmshared = false;
 
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_priority = ENV_PRIO_NORMAL;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -266,6 +353,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_pager = 0;
+	e->env_pager_va = 0;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
@@ -385,9 +474,18 @@ load_icode(struct Env *e, uint8_t *binary)
         }
 
         //cprintf("va = %p\n", ph->p_va);
-        region_alloc(e, (void *)ph->p_va, ph->p_memsz); 
-        memset((void *)ph->p_va, 0, ph->p_memsz);
+        // Only the pages holding file data get memory of their own;
+        // the rest of the bss maps the zero page until written.
+        uintptr_t filend = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+        uintptr_t va;
+        int r;
+
+        region_alloc(e, (void *)ph->p_va, ph->p_filesz); 
+        memset((void *)ph->p_va, 0, filend - ph->p_va);
         memcpy((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
+        for (va = filend; va < ph->p_va + ph->p_memsz; va += PGSIZE)
+            if ((r = page_insert_zero(e->env_pgdir, (void *)va, PTE_U)) < 0)
+                panic("load_icode: %e", r);
     }
 
     e->env_tf.tf_eip = elf->e_entry;
@@ -416,7 +514,9 @@ env_create(uint8_t *binary, enum EnvType type)
     struct Env *env;
     int rtn;
 
+    spin_lock(&env_table_lock);
     rtn = env_alloc(&env, 0);
+    spin_unlock(&env_table_lock);
     if (rtn < 0) {
         panic("error in env_create: %e", rtn);
     }
@@ -431,10 +531,21 @@ env_create(uint8_t *binary, enum EnvType type)
     if (type == ENV_TYPE_FS) {
         env->env_tf.tf_eflags |= FL_IOPL_MASK;
     }
+
+    spin_lock(&sched_lock);
+    // System servers sit on the latency path of every user env.
+    if (type != ENV_TYPE_USER) {
+        sched_set_priority(env, ENV_PRIO_SERVER);
+    }
+    env->env_status = ENV_RUNNABLE;
+    sched_enqueue(env);
+    spin_unlock(&sched_lock);
 }
 
 //
 // Frees env e and all memory it uses.
+// The caller must hold env_table_lock, and e must already be off the
+// run queues: either it is curenv, or env_reclaim has detached it.
 //
 void
 env_free(struct Env *e)
@@ -452,6 +563,9 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Wait out anyone still editing e's address space.
+	env_lock(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -460,14 +574,23 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+		// unmap all PTEs in this page table, unless threads
+		// still share it
+		if (pa2page(pa)->pp_ref == 1) {
+			for (pteno = 0; pteno <= PTX(~0); pteno++) {
+				if (pt[pteno] & PTE_P)
+					page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+			}
 		}
 
 		// free the page table itself
@@ -479,30 +602,52 @@ env_free(struct Env *e)
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
+	env_unlock(e);
 
 	// return the environment to the free list
+	spin_lock(&sched_lock);
+	sched_unsleep(e);
+	spin_unlock(&sched_lock);
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
 }
 
 //
-// Frees environment e.
-// If e was the current env, then runs a new environment (and does not return
-// to the caller).
+// Takes env e out of the scheduler and frees it.  If e is running on
+// another CPU, it is instead marked ENV_DYING, and will be freed the
+// next time it traps into the kernel.  If e is already ENV_DYING on
+// another CPU, that CPU will free it, so this does nothing.
+// The caller must hold env_table_lock.
 //
 void
-env_destroy(struct Env *e)
+env_reclaim(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
+	spin_lock(&sched_lock);
+	if ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING)
+	    && curenv != e) {
 		e->env_status = ENV_DYING;
+		spin_unlock(&sched_lock);
 		return;
 	}
+	sched_dequeue(e);
+	e->env_status = ENV_DYING;
+	spin_unlock(&sched_lock);
 
 	env_free(e);
+}
+
+//
+// Frees environment e.
+// If e was the current env, then runs a new environment (and does not return
+// to the caller).
+//
+void
+env_destroy(struct Env *e)
+{
+	spin_lock(&env_table_lock);
+	env_reclaim(e);
+	spin_unlock(&env_table_lock);
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -539,6 +684,7 @@ env_pop_tf(struct Trapframe *tf)
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
+// The caller must hold sched_lock, which env_run releases.
 //
 // This function does not return.
 //
@@ -566,16 +712,29 @@ env_run(struct Env *e)
 
     if (curenv && curenv->env_status == ENV_RUNNING && curenv != e) {
         curenv->env_status = ENV_RUNNABLE;
+        sched_enqueue(curenv);
     }
     
+    sched_dequeue(e);
     curenv = e;
-    curenv->env_status = ENV_RUNNING;
+    // A zombie runs until its next trap, which frees it.
+    if (curenv->env_status != ENV_DYING)
+        curenv->env_status = ENV_RUNNING;
     curenv->env_runs++;
 	curenv->env_cpunum = cpunum();
 
+    // Switch address spaces before other CPUs can pick up the env we
+    // just left, which could then exit and free its page directory.
     lcr3(PADDR(curenv->env_pgdir));
+    // That flushed the TLB, so it answers any pending shootdown.
+    tlb_shootdown_poll();
+
+    // Point %gs at our entry in UENVS, for thisenv.
+    gdt[(GD_UENV0 >> 3) + cpunum()] =
+        SEG16(0, UENVS + ENVX(curenv->env_id) * sizeof(struct Env), sizeof(struct Env) - 1, 3);
+    asm volatile("movw %%ax,%%gs" :: "a" ((GD_UENV0 + (cpunum() << 3)) | 3));
 
-    unlock_kernel();
+    spin_unlock(&sched_lock);
     env_pop_tf(&(curenv->env_tf));
 }
 
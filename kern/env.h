@@ -10,12 +10,27 @@ extern struct Env *envs;		// All environments
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
+// Per-CPU user segments that env_run points at the running env's entry
+// in UENVS and loads into %gs, so that threads sharing an address space
+// can each find their own Env (see thisenv in inc/lib.h).
+#define GD_UENV0	(GD_TSS0 + (NCPU << 3))
+
+// Threads share every page table of their address space except the
+// one covering the stacks, just below UTOP, which each keeps private.
+#define ENV_PRIVATE_PDX	PDX(UTOP - 1)
+
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
+void	env_reclaim(struct Env *e);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock_pair(struct Env *a, struct Env *b);
+void	env_unlock_pair(struct Env *a, struct Env *b);
+void	env_vm_sync(struct Env *e, void *va);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
@@ -54,13 +54,6 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-    lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
-
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -83,6 +76,11 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Starting non-boot CPUs.  Do this only once the initial envs
+	// exist, so that an AP entering the scheduler finds work instead
+	// of concluding the system is idle.
+	boot_aps();
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -124,6 +122,7 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	mem_init_percpu();
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -133,11 +132,8 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-    lock_kernel();
+	// to start running processes on this CPU.  The scheduler does its
+	// own locking, so any number of CPUs may enter it at once.
     sched_yield();
 
 	// Remove this after you finish Exercise 4
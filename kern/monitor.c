@@ -11,6 +11,8 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
+#include <kern/pmap.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -26,6 +28,8 @@ static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
     { "backtrace", "Display the current calling stack", mon_backtrace},
+    { "lockstat", "Display spinlock contention ('lockstat reset' clears it)", mon_lockstat},
+    { "buddyinfo", "Display free physical memory by block size", mon_buddyinfo},
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -88,6 +92,80 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 }
 
 
+#define NLOCKSTAT 32
+
+// Locks with the same name (e.g. all the per-env locks) are summed
+// into one line.  Cycles are TSC cycles.
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+    struct {
+        const char *name;
+        int nlocks;
+        uint64_t acquires, contended, spin_cycles, hold_max;
+    } stats[NLOCKSTAT];
+    struct spinlock *lk;
+    int i, n = 0;
+
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        spin_stats_reset();
+        return 0;
+    }
+
+    for (lk = spin_stats_list(); lk; lk = lk->stat_link) {
+        for (i = 0; i < n; i++)
+            if (strcmp(stats[i].name, lk->name) == 0)
+                break;
+        if (i == n) {
+            if (n == NLOCKSTAT)
+                continue;
+            memset(&stats[n], 0, sizeof(stats[n]));
+            stats[n++].name = lk->name;
+        }
+        stats[i].nlocks++;
+        stats[i].acquires += lk->acquires;
+        stats[i].contended += lk->contended;
+        stats[i].spin_cycles += lk->spin_cycles;
+        if (lk->hold_max > stats[i].hold_max)
+            stats[i].hold_max = lk->hold_max;
+    }
+
+    cprintf("%-16s %5s %12s %10s %14s %12s\n", "lock", "count",
+            "acquires", "contended", "spin cycles", "max hold");
+    for (i = 0; i < n; i++)
+        cprintf("%-16s %5d %12llu %10llu %14llu %12llu\n", stats[i].name,
+                stats[i].nlocks, stats[i].acquires, stats[i].contended,
+                stats[i].spin_cycles, stats[i].hold_max);
+    return 0;
+}
+
+// The fragmentation figure is the share of free memory that can't
+// satisfy a request for the largest free block size.
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+    size_t nblocks[PAGE_NORDER];
+    size_t nfree = 0, largest = 0;
+    int order;
+
+    page_buddy_stats(nblocks);
+
+    cprintf("order  blocks  pages\n");
+    for (order = 0; order < PAGE_NORDER; order++) {
+        cprintf("%5d %7u %6u\n", order, nblocks[order],
+                nblocks[order] << order);
+        nfree += nblocks[order] << order;
+        if (nblocks[order])
+            largest = order;
+    }
+    cprintf("free pages: %u, largest block: %u pages", nfree, 1 << largest);
+    if (nfree)
+        cprintf(", fragmentation: %u%%",
+                100 - 100 * (nblocks[largest] << largest) / nfree);
+    cprintf("\n");
+    return 0;
+}
+
 
 /***** Kernel monitor command interpreter *****/
 
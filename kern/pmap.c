@@ -10,6 +10,8 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/syscall.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;          // Amount of physical memory (in pages)
@@ -20,6 +22,105 @@ pde_t *kern_pgdir;      // Kernel's initial page directory
 struct PageInfo *pages;     // Physical page state array
 static struct PageInfo *page_free_list; // Free list of physical pages
 
+// Once mem_init is done, free pages are managed by a buddy allocator
+// instead of page_free_list.  Each free block of 2^k contiguous pages,
+// aligned to its size, sits on buddy_free_area[k], doubly linked
+// through pp_link and pp_prev, and its first page has pp_order == k.
+// Every other page has pp_order == -1 and a NULL pp_link.  Protected
+// by page_lock.
+static struct PageInfo *buddy_free_area[PAGE_NORDER];
+static size_t buddy_nfree[PAGE_NORDER];    // Blocks on each list
+static bool buddy_ready;        // Off while mem_init checks page_free_list
+
+// Per-CPU caches ("magazines") of free pages, so that most page_alloc
+// and page_free calls don't touch the buddy lists or page_lock.  A CPU
+// refills its magazine from the buddy allocator, and spills back to
+// it, in batches of PAGE_MAG_BATCH pages.  Normally only the owning CPU
+// touches a magazine, but an allocation that would otherwise fail
+// drains them all (see page_mag_drain), so each has a bare xchg lock,
+// pm_busy, that the owner takes without contention.  It nests outside
+// page_lock.
+#define PAGE_MAG_BATCH	16
+#define PAGE_MAG_MAX	(2 * PAGE_MAG_BATCH)
+
+struct PageMagazine {
+    struct PageInfo *pm_head;
+    int pm_count;
+    volatile uint32_t pm_busy;
+};
+
+static struct PageMagazine page_mags[NCPU];
+
+static void
+page_mag_lock(struct PageMagazine *pm)
+{
+    while (xchg(&pm->pm_busy, 1) != 0)
+        asm volatile("pause");
+}
+
+static void
+page_mag_unlock(struct PageMagazine *pm)
+{
+    xchg(&pm->pm_busy, 0);
+}
+
+// Pages zeroed ahead of time by idle CPUs, so that page_alloc(ALLOC_ZERO)
+// can usually skip the memset.  Linked through pp_link; protected by
+// page_lock.  Ordinary allocations fall back to it when all else is empty.
+#define PAGE_ZERO_POOL_MAX	512
+
+static struct PageInfo *page_zero_pool;
+static int page_zero_pool_len;
+
+// A single page of zeros, mapped copy-on-write wherever a process has
+// memory it has not written yet.  It holds a permanent reference and
+// is never freed.  Past ZERO_PAGE_MAXREF mappings (pp_ref is only 16
+// bits) page_insert maps private zeroed pages instead.
+#define ZERO_PAGE_MAXREF	60000
+
+struct PageInfo *zero_page;
+
+// Does the CPU support 4MB pages (CPUID.1:EDX.PSE)?
+bool pse_supported;
+// Does it support global pages (CPUID.1:EDX.PGE)?
+static bool pge_supported;
+
+// TLB shootdown.
+//
+// Changing a PTE that another CPU may have cached takes an IPI
+// (T_TLBFLUSH) to that CPU, and a wait until it has flushed.  Requests
+// go through a per-CPU mailbox of addresses to invlpg; past
+// TLB_FLUSH_MAX of them the CPU flushes its whole TLB instead, which
+// is cheaper by then.  Between tlb_batch_begin and tlb_batch_end,
+// tlb_invalidate only records what needs flushing, so that a bulk
+// update costs one IPI per CPU rather than one per page.  Pages freed
+// in the meantime are held back until the flush, since other CPUs
+// could still reach them through stale entries.
+#define TLB_FLUSH_MAX	32
+
+struct TlbMailbox {
+    volatile uint32_t tm_lock;      // Held briefly, never while waiting
+    volatile uint32_t tm_req;       // Flushes requested of this CPU
+    volatile uint32_t tm_done;      // ... and carried out
+    int tm_nva;                     // Addresses queued; > TLB_FLUSH_MAX: all
+    uintptr_t tm_va[TLB_FLUSH_MAX];
+};
+
+struct TlbBatch {
+    bool tb_active;
+    bool tb_local;                  // This CPU must flush too
+    uint32_t tb_mask;               // Other CPUs that must flush
+    int tb_nva;                     // As tm_nva
+    uintptr_t tb_va[TLB_FLUSH_MAX];
+    struct PageInfo *tb_free;       // Pages to free after the flush
+    struct PageInfo *tb_free_large; // 4MB blocks to free after it
+};
+
+static struct TlbMailbox tlb_mailbox[NCPU];
+static struct TlbBatch tlb_batch[NCPU];
+
+static void buddy_init(void);
+
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -135,6 +236,11 @@ mem_init(void)
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
+	uint32_t edx;
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pse_supported = (edx & (1 << 3)) != 0;
+	pge_supported = (edx & (1 << 13)) != 0;
+
 	// Remove this line when you're ready to test this function.
 	// panic("mem_init: This function is not finished\n");
 
@@ -224,6 +330,7 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
+	// (boot_map_region uses 4MB pages here if the CPU has them.)
     boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(~KERNBASE+1, PGSIZE), 0, PTE_W);
 
 	// Initialize the SMP-related parts of the memory map
@@ -239,6 +346,7 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+	mem_init_percpu();
 	lcr3(PADDR(kern_pgdir));
 
 	check_page_free_list(0);
@@ -252,6 +360,24 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// The checks above expect every free page on page_free_list.
+	buddy_init();
+
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref = 1;
+}
+
+// Set the paging features that kern_pgdir relies on in this CPU's
+// control registers.  Must be called before loading kern_pgdir.
+void
+mem_init_percpu(void)
+{
+	if (pse_supported)
+		lcr4(rcr4() | CR4_PSE);
+	if (pge_supported)
+		lcr4(rcr4() | CR4_PGE);
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -346,6 +472,186 @@ page_init(void)
     }
 }
 
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+    pp->pp_order = order;
+    pp->pp_prev = NULL;
+    pp->pp_link = buddy_free_area[order];
+    if (pp->pp_link)
+        pp->pp_link->pp_prev = pp;
+    buddy_free_area[order] = pp;
+    buddy_nfree[order]++;
+}
+
+static void
+buddy_remove(struct PageInfo *pp, int order)
+{
+    if (pp->pp_prev)
+        pp->pp_prev->pp_link = pp->pp_link;
+    else
+        buddy_free_area[order] = pp->pp_link;
+    if (pp->pp_link)
+        pp->pp_link->pp_prev = pp->pp_prev;
+    pp->pp_link = pp->pp_prev = NULL;
+    pp->pp_order = -1;
+    buddy_nfree[order]--;
+}
+
+// Take a block of 2^order pages, splitting a larger one if need be.
+// The caller must hold page_lock.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+    struct PageInfo *pp;
+    int o;
+
+    for (o = order; o < PAGE_NORDER && !buddy_free_area[o]; o++)
+        ;
+    if (o == PAGE_NORDER)
+        return NULL;
+
+    pp = buddy_free_area[o];
+    buddy_remove(pp, o);
+    // Give back the upper half until the block is the right size.
+    while (o > order) {
+        o--;
+        buddy_push(pp + (1 << o), o);
+    }
+    return pp;
+}
+
+// Return a block of 2^order pages, merging it with its buddy for as
+// long as the buddy is free too.  The caller must hold page_lock.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+    size_t pfn = pp - pages, bpfn;
+
+    while (order < PAGE_MAX_ORDER) {
+        bpfn = pfn ^ (1 << order);
+        if (bpfn >= npages || pages[bpfn].pp_order != order)
+            break;
+        buddy_remove(&pages[bpfn], order);
+        pfn &= ~(1 << order);
+        order++;
+    }
+    buddy_push(&pages[pfn], order);
+}
+
+// Move every page on page_free_list into the buddy allocator.
+static void
+buddy_init(void)
+{
+    struct PageInfo *pp, *next;
+    size_t i;
+
+    for (i = 0; i < npages; i++)
+        pages[i].pp_order = -1;
+
+    spin_lock(&page_lock);
+    for (pp = page_free_list; pp; pp = next) {
+        next = pp->pp_link;
+        pp->pp_link = NULL;
+        buddy_free(pp, 0);
+    }
+    page_free_list = NULL;
+    buddy_ready = 1;
+    spin_unlock(&page_lock);
+}
+
+// Take a page from this CPU's magazine, refilling it from the buddy
+// allocator if need be (or from page_free_list during mem_init).
+// Returns NULL if there are none.
+static struct PageInfo *
+page_take(void)
+{
+    struct PageMagazine *pm = &page_mags[cpunum()];
+    struct PageInfo *res;
+
+    if (!buddy_ready) {
+        spin_lock(&page_lock);
+        res = page_free_list;
+        if (res)
+            page_free_list = res->pp_link;
+        spin_unlock(&page_lock);
+    } else {
+        page_mag_lock(pm);
+        if (!pm->pm_head) {
+            // Take a batch of pages in one go.
+            spin_lock(&page_lock);
+            while (pm->pm_count < PAGE_MAG_BATCH
+                   && (res = buddy_alloc(0))) {
+                res->pp_link = pm->pm_head;
+                pm->pm_head = res;
+                pm->pm_count++;
+            }
+            spin_unlock(&page_lock);
+        }
+        res = pm->pm_head;
+        if (res) {
+            pm->pm_head = res->pp_link;
+            pm->pm_count--;
+        }
+        page_mag_unlock(pm);
+    }
+
+    if (res) {
+        res->pp_link = NULL;
+        res->pp_ref = 0;
+    }
+    return res;
+}
+
+// Give the pages in every CPU's magazine back to the buddy allocator,
+// where other CPUs can get at them, and coalesce them into larger
+// blocks.  For when memory is about to run out.  Returns the number of
+// pages given back.
+static int
+page_mag_drain(void)
+{
+    struct PageMagazine *pm;
+    struct PageInfo *pp;
+    int n = 0;
+
+    if (!buddy_ready)
+        return 0;
+    for (pm = page_mags; pm < page_mags + NCPU; pm++) {
+        page_mag_lock(pm);
+        spin_lock(&page_lock);
+        while ((pp = pm->pm_head)) {
+            pm->pm_head = pp->pp_link;
+            pp->pp_link = NULL;
+            buddy_free(pp, 0);
+            n++;
+        }
+        pm->pm_count = 0;
+        spin_unlock(&page_lock);
+        page_mag_unlock(pm);
+    }
+    return n;
+}
+
+// Take an already-zeroed page from the zero pool, or NULL if it's empty.
+static struct PageInfo *
+page_zero_take(void)
+{
+    struct PageInfo *res;
+
+    spin_lock(&page_lock);
+    if ((res = page_zero_pool)) {
+        page_zero_pool = res->pp_link;
+        page_zero_pool_len--;
+    }
+    spin_unlock(&page_lock);
+
+    if (res) {
+        res->pp_link = NULL;
+        res->pp_ref = 0;
+    }
+    return res;
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -362,15 +668,21 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
     // Fill this function in
-    if (!page_free_list) {
-        return NULL;
+    struct PageInfo *res;
+
+    if ((alloc_flags & ALLOC_ZERO) && page_zero_pool
+        && (res = page_zero_take()))
+        return res;
+
+    if (!(res = page_take())) {
+        // Out of ordinary pages; the zero pool is what is left, and
+        // then whatever other CPUs' magazines hold.
+        if ((res = page_zero_take()) || !page_mag_drain())
+            return res;
+        if (!(res = page_take()))
+            return NULL;
     }
 
-    struct PageInfo *res = page_free_list;
-    page_free_list = page_free_list->pp_link;
-    res->pp_link = NULL;
-    res->pp_ref = 0;
-
     if (alloc_flags & ALLOC_ZERO) {
         memset(page2kva(res), '\0', PGSIZE); 
     }
@@ -378,6 +690,39 @@ page_alloc(int alloc_flags)
     return res;
 }
 
+// Zero up to n free pages into the zero pool, stopping once it is full.
+// Called by CPUs with nothing better to do.  Returns the number zeroed.
+int
+page_zero_refill(int n)
+{
+    struct PageInfo *pp;
+    int i;
+
+    if (!buddy_ready)
+        return 0;
+    for (i = 0; i < n; i++) {
+        if (page_zero_pool_len >= PAGE_ZERO_POOL_MAX)
+            break;
+        if (!(pp = page_take()))
+            break;
+        memset(page2kva(pp), 0, PGSIZE);
+        spin_lock(&page_lock);
+        pp->pp_link = page_zero_pool;
+        page_zero_pool = pp;
+        page_zero_pool_len++;
+        spin_unlock(&page_lock);
+    }
+    return i;
+}
+
+// Map the shared zero page at va in pgdir, read-only and copy-on-write.
+// perm is as for page_insert; PTE_W is dropped and PTE_COW added.
+int
+page_insert_zero(pde_t *pgdir, void *va, int perm)
+{
+    return page_insert(pgdir, zero_page, va, (perm & ~PTE_W) | PTE_COW);
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -392,8 +737,153 @@ page_free(struct PageInfo *pp)
         panic("pp_ref is nonzero or pp_link is not NULL");
     }
 
-    pp->pp_link = page_free_list;
-    page_free_list = pp;
+    if (!buddy_ready) {
+        spin_lock(&page_lock);
+        pp->pp_link = page_free_list;
+        page_free_list = pp;
+        spin_unlock(&page_lock);
+        return;
+    }
+
+    struct PageMagazine *pm = &page_mags[cpunum()];
+    page_mag_lock(pm);
+    pp->pp_link = pm->pm_head;
+    pm->pm_head = pp;
+    if (++pm->pm_count >= PAGE_MAG_MAX) {
+        // Full: give a batch back, so other CPUs can have it.
+        spin_lock(&page_lock);
+        while (pm->pm_count > PAGE_MAG_MAX - PAGE_MAG_BATCH) {
+            pp = pm->pm_head;
+            pm->pm_head = pp->pp_link;
+            pm->pm_count--;
+            pp->pp_link = NULL;
+            buddy_free(pp, 0);
+        }
+        spin_unlock(&page_lock);
+    }
+    page_mag_unlock(pm);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// and returns the PageInfo of the first.  alloc_flags is as for
+// page_alloc.  Reference counts are left at zero; each page can later
+// be released on its own with page_free, or the whole block at once
+// with page_free_order.
+//
+// Returns NULL if there is no free block that large, or before
+// mem_init has finished.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+    struct PageInfo *pp;
+
+    if (order == 0)
+        return page_alloc(alloc_flags);
+    if (order < 0 || order > PAGE_MAX_ORDER || !buddy_ready)
+        return NULL;
+
+    spin_lock(&page_lock);
+    pp = buddy_alloc(order);
+    spin_unlock(&page_lock);
+    if (!pp && page_mag_drain()) {
+        // Pages sitting in magazines may coalesce into a block now
+        spin_lock(&page_lock);
+        pp = buddy_alloc(order);
+        spin_unlock(&page_lock);
+    }
+
+    if (pp && (alloc_flags & ALLOC_ZERO))
+        memset(page2kva(pp), 0, PGSIZE << order);
+    return pp;
+}
+
+//
+// Return a block from page_alloc_order.  Every page in it must have
+// a zero reference count.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+    if (order == 0) {
+        page_free(pp);
+        return;
+    }
+    assert(buddy_ready);
+    assert(((pp - pages) & ((1 << order) - 1)) == 0);
+
+    spin_lock(&page_lock);
+    buddy_free(pp, order);
+    spin_unlock(&page_lock);
+}
+
+//
+// Copy out the number of free blocks of each order, for fragmentation
+// statistics.  Pages cached in per-CPU magazines are not counted.
+//
+void
+page_buddy_stats(size_t nblocks[PAGE_NORDER])
+{
+    spin_lock(&page_lock);
+    memmove(nblocks, buddy_nfree, sizeof(buddy_nfree));
+    spin_unlock(&page_lock);
+}
+
+//
+// Map the 4MB block pp (from page_alloc_order(PAGE_LARGE_ORDER, ...))
+// at the PTSIZE-aligned 'va' with a single PTE_PS page directory entry.
+// The block's reference count is kept in pp->pp_ref.  A large page
+// already mapped at va is replaced, as is an empty page table.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL if part of [va, va+PTSIZE) is already mapped with 4KB pages
+//
+int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    pte_t *pt;
+    int i;
+
+    assert((uintptr_t) va % PTSIZE == 0);
+    assert(pse_supported);
+    if ((*pde & PTE_P) && !(*pde & PTE_PS)) {
+        pt = KADDR(PTE_ADDR(*pde));
+        for (i = 0; i < NPTENTRIES; i++)
+            if (pt[i] & PTE_P)
+                return -E_INVAL;
+        *pde = 0;
+        tlb_invalidate(pgdir, va);
+        page_decref(pa2page(PADDR(pt)));
+    }
+
+    spin_lock(&page_lock);
+    pp->pp_ref++;
+    spin_unlock(&page_lock);
+    if (*pde & PTE_P)
+        page_remove(pgdir, va);
+
+    *pde = page2pa(pp) | perm | PTE_PS | PTE_P;
+    return 0;
+}
+
+//
+// Return the first page of the 4MB page mapped at va, or NULL if va
+// is not in a large page.  If pde_store is not zero, the address of
+// its page directory entry is stored there.
+//
+struct PageInfo *
+page_lookup_large(pde_t *pgdir, void *va, pde_t **pde_store)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+
+    if ((*pde & (PTE_PS | PTE_P)) != (PTE_PS | PTE_P))
+        return NULL;
+    if (pde_store)
+        *pde_store = pde;
+    return pa2page(PTE_ADDR(*pde));
 }
 
 //
@@ -403,7 +893,34 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-    if (--pp->pp_ref == 0)
+    page_decref_order(pp, 0);
+}
+
+//
+// Likewise for a block of 2^order pages.  Inside a TLB batch, the
+// block is freed at tlb_batch_end instead.
+//
+void
+page_decref_order(struct PageInfo *pp, int order)
+{
+    struct TlbBatch *tb = &tlb_batch[cpunum()];
+    int ref;
+
+    spin_lock(&page_lock);
+    ref = --pp->pp_ref;
+    spin_unlock(&page_lock);
+    if (ref != 0)
+        return;
+
+    if (tb->tb_active && order == 0) {
+        pp->pp_link = tb->tb_free;
+        tb->tb_free = pp;
+    } else if (tb->tb_active && order == PAGE_LARGE_ORDER) {
+        pp->pp_link = tb->tb_free_large;
+        tb->tb_free_large = pp;
+    } else if (order)
+        page_free_order(pp, order);
+    else
         page_free(pp);
 }
 
@@ -437,7 +954,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
     pte_t *pgtable;
 
     pde = &pgdir[PDX(va)];
-    if (*pde & PTE_P) {
+    if (*pde & PTE_PS) {
+        // A 4MB page: there is no page table to walk.
+        return NULL;
+    } else if (*pde & PTE_P) {
         pgtable = KADDR(PTE_ADDR(*pde));
     } else {
         if (create) {
@@ -470,6 +990,9 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// These mappings are the same in every env's page directory, so they
+// are made global: the TLB keeps them across the lcr3 in env_run.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
@@ -477,8 +1000,20 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
     // Fill this function in
     pte_t *pteaddr;
     size = ROUNDUP(size, PGSIZE);
+    if (pge_supported)
+        perm |= PTE_G;
 
     for (; size > 0; size -= PGSIZE) {
+        // Map whole 4MB-aligned chunks with a single large page.
+        if (pse_supported && size >= PTSIZE
+            && va % PTSIZE == 0 && pa % PTSIZE == 0) {
+            pgdir[PDX(va)] = pa | perm | PTE_PS | PTE_P;
+            va += PTSIZE;
+            pa += PTSIZE;
+            size -= PTSIZE - PGSIZE;
+            continue;
+        }
+
         pteaddr = pgdir_walk(pgdir, (void *)va, 1);
         if (!pteaddr) {
             panic("boot_map_region: pgdir_walk fail\n");
@@ -528,8 +1063,13 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
     if (!pteaddr) {
         return -E_NO_MEM;
     }
+    if (pp == zero_page && pp->pp_ref >= ZERO_PAGE_MAXREF
+        && !(pp = page_alloc(ALLOC_ZERO)))
+        return -E_NO_MEM;
 
+    spin_lock(&page_lock);
     pp->pp_ref++;
+    spin_unlock(&page_lock);
     if (*pteaddr & PTE_P) {
         page_remove(pgdir, va);
         tlb_invalidate(pgdir, va);
@@ -587,26 +1127,200 @@ page_remove(pde_t *pgdir, void *va)
     // Fill this function in
 
     pte_t *pteaddr;
-    struct PageInfo *pp = page_lookup(pgdir, va, &pteaddr);
+    struct PageInfo *pp;
+
+    if ((pp = page_lookup_large(pgdir, va, &pteaddr))) {
+        *pteaddr = 0;
+        tlb_invalidate(pgdir, va);
+        page_decref_order(pp, PAGE_LARGE_ORDER);
+        return;
+    }
+
+    pp = page_lookup(pgdir, va, &pteaddr);
     if (!pp) {
         return;
     }
 
+    // Invalidate before the page can be freed and reused.
     *pteaddr = 0;
-    page_decref(pp); 
     tlb_invalidate(pgdir, va);
+    page_decref(pp); 
+}
+
+// Could env e's TLB entries for va come from pgdir?  Either e runs on
+// pgdir, or it is a thread whose page directory shares the page table
+// (or 4MB page) mapping va.
+static bool
+tlb_uses(struct Env *e, pde_t *pgdir, void *va)
+{
+    pde_t *epgdir = e->env_pgdir;
+
+    if (epgdir == pgdir)
+        return true;
+    return epgdir && (uintptr_t) va < UTOP
+        && (pgdir[PDX(va)] & PTE_P) && epgdir[PDX(va)] == pgdir[PDX(va)];
+}
+
+// The other CPUs that may cache a translation of va through pgdir.
+static uint32_t
+tlb_cpus(pde_t *pgdir, void *va)
+{
+    uint32_t mask = 0;
+    struct Env *e;
+    int i;
+
+    // Order the PTE update before the checks of what other CPUs run.
+    // A CPU that switches to pgdir after this reloads %cr3 anyway.
+    __sync_synchronize();
+    for (i = 0; i < ncpu; i++)
+        if (&cpus[i] != thiscpu && (e = cpus[i].cpu_env) && tlb_uses(e, pgdir, va))
+            mask |= 1 << i;
+    return mask;
+}
+
+// Flush nva addresses from this CPU's TLB, or all of it.
+static void
+tlb_flush_local(int nva, const uintptr_t *va)
+{
+    int i;
+
+    if (nva > TLB_FLUSH_MAX)
+        lcr3(rcr3());
+    else
+        for (i = 0; i < nva; i++)
+            invlpg((void *) va[i]);
+}
+
+// Carry out any TLB flush other CPUs have requested of this one.
+// Called from the T_TLBFLUSH handler, and while spinning on a lock,
+// since the kernel runs with interrupts off and the CPU asking may be
+// holding that lock.
+void
+tlb_shootdown_poll(void)
+{
+    struct TlbMailbox *tm = &tlb_mailbox[cpunum()];
+    uint32_t req = tm->tm_req;
+
+    if (req == tm->tm_done)
+        return;
+    while (xchg(&tm->tm_lock, 1))
+        asm volatile("pause");
+    tlb_flush_local(tm->tm_nva, tm->tm_va);
+    tm->tm_nva = 0;
+    xchg(&tm->tm_lock, 0);
+    tm->tm_done = req;
+}
+
+// Have the CPUs in mask flush nva addresses (or everything), and wait
+// until they have.
+static void
+tlb_shootdown(uint32_t mask, int nva, const uintptr_t *va)
+{
+    uint32_t want[NCPU];
+    struct TlbMailbox *tm;
+    int i;
+
+    for (i = 0; i < ncpu; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        tm = &tlb_mailbox[i];
+        while (xchg(&tm->tm_lock, 1))
+            asm volatile("pause");
+        if (nva > TLB_FLUSH_MAX || tm->tm_nva + nva > TLB_FLUSH_MAX)
+            tm->tm_nva = TLB_FLUSH_MAX + 1;
+        else {
+            memmove(&tm->tm_va[tm->tm_nva], va, nva * sizeof(*va));
+            tm->tm_nva += nva;
+        }
+        xchg(&tm->tm_lock, 0);
+        want[i] = xadd(&tm->tm_req, 1) + 1;
+        lapic_ipi_cpu(cpus[i].cpu_id, T_TLBFLUSH);
+    }
+
+    for (i = 0; i < ncpu; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        while ((int32_t) (tlb_mailbox[i].tm_done - want[i]) < 0) {
+            tlb_shootdown_poll();
+            asm volatile("pause");
+        }
+    }
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Other CPUs running on them are interrupted to flush their TLBs,
+// and this waits until they have -- or, inside a batch, at
+// tlb_batch_end.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+    struct TlbBatch *tb = &tlb_batch[cpunum()];
+    uintptr_t a = (uintptr_t) va;
+    bool local = !curenv || tlb_uses(curenv, pgdir, va);
+    uint32_t mask = ncpu > 1 ? tlb_cpus(pgdir, va) : 0;
+
+    if (tb->tb_active) {
+        if (!local && !mask)
+            return;
+        tb->tb_local |= local;
+        tb->tb_mask |= mask;
+        if (tb->tb_nva < TLB_FLUSH_MAX)
+            tb->tb_va[tb->tb_nva++] = a;
+        else
+            tb->tb_nva = TLB_FLUSH_MAX + 1;
+        return;
+    }
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (local)
 		invlpg(va);
+    if (mask)
+        tlb_shootdown(mask, 1, &a);
+}
+
+// Start deferring this CPU's TLB invalidations, and the freeing of
+// pages that drop their last reference, until tlb_batch_end.  Batches
+// don't nest.
+void
+tlb_batch_begin(void)
+{
+    struct TlbBatch *tb = &tlb_batch[cpunum()];
+
+    assert(!tb->tb_active);
+    tb->tb_active = true;
+    tb->tb_local = false;
+    tb->tb_mask = 0;
+    tb->tb_nva = 0;
+}
+
+// Carry out the invalidations recorded since tlb_batch_begin, here and
+// on other CPUs, then free the pages held back.
+void
+tlb_batch_end(void)
+{
+    struct TlbBatch *tb = &tlb_batch[cpunum()];
+    struct PageInfo *pp;
+
+    assert(tb->tb_active);
+    tb->tb_active = false;
+    if (tb->tb_local)
+        tlb_flush_local(tb->tb_nva, tb->tb_va);
+    if (tb->tb_mask)
+        tlb_shootdown(tb->tb_mask, tb->tb_nva, tb->tb_va);
+
+    while ((pp = tb->tb_free)) {
+        tb->tb_free = pp->pp_link;
+        pp->pp_link = NULL;
+        page_free(pp);
+    }
+    while ((pp = tb->tb_free_large)) {
+        tb->tb_free_large = pp->pp_link;
+        pp->pp_link = NULL;
+        page_free_order(pp, PAGE_LARGE_ORDER);
+    }
 }
 
 //
@@ -685,9 +1399,11 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
     pte_t *pte;
     for (; va_ < end_; va_ += PGSIZE) {
-        pte = pgdir_walk(env->env_pgdir, va_, 0);
-        if (va_ >= (void *)ULIM || 
-            !pte ||
+        pte = NULL;
+        if (va_ < (void *)ULIM
+            && !page_lookup_large(env->env_pgdir, va_, &pte))
+            pte = pgdir_walk(env->env_pgdir, va_, 0);
+        if (!pte ||
             (*pte & perm) != perm) {
 
             user_mem_check_addr = (uintptr_t)((va_ < va)? va: va_);
@@ -698,20 +1414,49 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	return 0;
 }
 
+// A system call by curenv found the page at va not present.  If curenv
+// has a pager for it, have the page brought in, with curenv set to
+// restart the system call once it is; this may not return.  Returns
+// true if the page is there now, false if no pager can bring it in.
+static bool
+user_mem_page_in(uintptr_t va)
+{
+	pte_t *pte = NULL;
+	bool mapped;
+
+	if (curenv->env_tf.tf_trapno != T_SYSCALL)
+		return false;
+	if (!page_lookup_large(curenv->env_pgdir, (void *) va, &pte))
+		pte = pgdir_walk(curenv->env_pgdir, (void *) va, 0);
+	if (pte && (*pte & PTE_P))
+		return false;
+
+	// Back up over the int $T_SYSCALL, for when curenv is resumed.
+	curenv->env_tf.tf_eip -= 2;
+	mapped = pager_fault(va);
+	curenv->env_tf.tf_eip += 2;
+	return mapped;
+}
+
 //
 // Checks that environment 'env' is allowed to access the range
 // of memory [va, va+len) with permissions 'perm | PTE_U | PTE_P'.
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// Pages of curenv's that its pager has yet to bring in are paged in
+// first, so the caller must not hold any locks.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
+	while (user_mem_check(env, va, len, perm | PTE_U) < 0) {
+		if (env == curenv && user_mem_page_in(user_mem_check_addr))
+			continue;
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
 		env_destroy(env);	// may not return
+		return;
 	}
 }
 
@@ -938,6 +1683,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
     pgdir = &pgdir[PDX(va)];
     if (!(*pgdir & PTE_P))
         return ~0;
+    if (*pgdir & PTE_PS)
+        return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
     p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
     if (!(p[PTX(va)] & PTE_P))
         return ~0;
@@ -16,6 +16,8 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pde_t *kern_pgdir;
+extern struct PageInfo *zero_page;
+extern bool pse_supported;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -51,17 +53,36 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// page_alloc_order hands out blocks of up to 2^PAGE_MAX_ORDER pages (4MB).
+#define PAGE_MAX_ORDER	10
+#define PAGE_NORDER	(PAGE_MAX_ORDER + 1)
+
+// Order of the block backing a 4MB (PTE_PS) large page.
+#define PAGE_LARGE_ORDER	(PTSHIFT - PGSHIFT)
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+int	page_zero_refill(int n);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_buddy_stats(size_t nblocks[PAGE_NORDER]);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_zero(pde_t *pgdir, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_decref_order(struct PageInfo *pp, int order);
+int	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+struct PageInfo *page_lookup_large(pde_t *pgdir, void *va, pde_t **pde_store);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown_poll(void);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -18,7 +20,10 @@ vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
 
+	// Keep lines from different CPUs from interleaving.
+	spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	spin_unlock(&cons_lock);
 	return cnt;
 }
 
@@ -7,40 +7,283 @@
 
 void sched_halt(void);
 
-// Choose a user environment to run and run it.
-void
-sched_yield(void)
+// Per-CPU queues of ENV_RUNNABLE environments, one list per
+// priority level, linked through env_rq_next and env_rq_prev.  An env
+// is on at most one queue, recorded in env_rq_cpu.  The queues, and
+// every env's env_status and env_priority, are protected by sched_lock.
+struct RunList {
+    struct Env *rl_head;
+    struct Env *rl_tail;
+};
+
+struct RunQueue {
+    struct RunList rq_prio[NENVPRIO];
+    uint32_t rq_len;
+    uint32_t rq_clock;      // Number of envs popped from this queue
+};
+
+static struct RunQueue runqs[NCPU];
+
+// Envs in sys_sleep, soonest env_wakeup first, linked through
+// env_sleep_next.  An env is on it exactly when its env_wakeup is
+// nonzero.  Protected by sched_lock.
+static struct Env *sleepq;
+
+// An env that has sat on a queue while this many others were picked
+// ahead of it runs next regardless of priority, so that a busy server
+// cannot starve ordinary envs forever.
+#define SCHED_STARVE_LIMIT  16
+
+// Pages an idle CPU zeroes for the page allocator each time it halts.
+// Kept small so a CPU that is woken up does not take long to notice.
+#define SCHED_ZERO_REFILL   32
+
+static void
+runq_append(struct RunQueue *rq, struct Env *e)
 {
-	struct Env *idle;
+    struct RunList *rl = &rq->rq_prio[e->env_priority];
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-	// LAB 4: Your code here.
-    uint32_t envid = curenv? ENVX(thiscpu->cpu_env->env_id): -1;
-    uint32_t first_eid = (++envid) % NENV;
-    uint32_t next_envid;
+    e->env_rq_cpu = rq - runqs;
+    e->env_rq_stamp = rq->rq_clock;
+    e->env_rq_next = NULL;
+    e->env_rq_prev = rl->rl_tail;
+    if (rl->rl_tail)
+        rl->rl_tail->env_rq_next = e;
+    else
+        rl->rl_head = e;
+    rl->rl_tail = e;
+    rq->rq_len++;
+}
+
+// Pick the queue a newly runnable env should go on.  An env that has
+// run before goes back to the CPU it last ran on (env_cpunum), whose
+// caches are most likely to still hold its working set.  A fresh env
+// has no affinity yet, so spread it onto the shortest queue.
+static struct RunQueue *
+runq_select(struct Env *e)
+{
+    struct RunQueue *best;
     int i;
 
-    // case: env status is RUNNABLE
-    for (i = 0; i < NENV; i++) {
-        next_envid = (first_eid+i) % NENV;
-        if (envs[next_envid].env_status == ENV_RUNNABLE) {
-            env_run(&envs[next_envid]);
+    if (e->env_runs > 0 && e->env_cpunum < ncpu
+        && cpus[e->env_cpunum].cpu_status != CPU_UNUSED)
+        return &runqs[e->env_cpunum];
+
+    best = &runqs[cpunum()];
+    for (i = 0; i < ncpu; i++)
+        if (cpus[i].cpu_status != CPU_UNUSED && runqs[i].rq_len < best->rq_len)
+            best = &runqs[i];
+    return best;
+}
+
+// Append e to the tail of its preferred CPU's run queue.
+// Does nothing if e is already queued.  The caller must hold sched_lock.
+void
+sched_enqueue(struct Env *e)
+{
+    if (e->env_rq_cpu >= 0)
+        return;
+
+    runq_append(runq_select(e), e);
+}
+
+// Remove e from whatever run queue it is on, if any.
+// The caller must hold sched_lock.
+void
+sched_dequeue(struct Env *e)
+{
+    struct RunQueue *rq;
+    struct RunList *rl;
+
+    if (e->env_rq_cpu < 0)
+        return;
+
+    rq = &runqs[e->env_rq_cpu];
+    rl = &rq->rq_prio[e->env_priority];
+    if (e->env_rq_prev)
+        e->env_rq_prev->env_rq_next = e->env_rq_next;
+    else
+        rl->rl_head = e->env_rq_next;
+    if (e->env_rq_next)
+        e->env_rq_next->env_rq_prev = e->env_rq_prev;
+    else
+        rl->rl_tail = e->env_rq_prev;
+    rq->rq_len--;
+
+    e->env_rq_next = e->env_rq_prev = NULL;
+    e->env_rq_cpu = -1;
+}
+
+// Change e's priority, moving it to the matching list if it is queued.
+// The caller must hold sched_lock.
+void
+sched_set_priority(struct Env *e, int priority)
+{
+    int cpu = e->env_rq_cpu;
+
+    assert(priority >= 0 && priority < NENVPRIO);
+    if (cpu >= 0)
+        sched_dequeue(e);
+    e->env_priority = priority;
+    if (cpu >= 0)
+        runq_append(&runqs[cpu], e);
+}
+
+// Take e off the sleep queue, if it is on it.
+// The caller must hold sched_lock.
+void
+sched_unsleep(struct Env *e)
+{
+    struct Env **pp;
+
+    if (!e->env_wakeup)
+        return;
+    for (pp = &sleepq; *pp != e; pp = &(*pp)->env_sleep_next)
+        ;
+    *pp = e->env_sleep_next;
+    e->env_sleep_next = NULL;
+    e->env_wakeup = 0;
+}
+
+// Arrange for e, which is about to block, to be woken once time_msec()
+// reaches wakeup.
+void
+sched_sleep(struct Env *e, uint32_t wakeup)
+{
+    struct Env **pp;
+
+    spin_lock(&sched_lock);
+    sched_unsleep(e);
+    for (pp = &sleepq; *pp && (*pp)->env_wakeup <= wakeup;
+         pp = &(*pp)->env_sleep_next)
+        ;
+    e->env_wakeup = wakeup;
+    e->env_sleep_next = *pp;
+    *pp = e;
+    spin_unlock(&sched_lock);
+}
+
+// Make runnable the sleeping envs whose time is up by now, popping
+// them off the front of the sleep queue.  CPU 0 calls this on every
+// clock tick.
+void
+sched_wakeup(uint32_t now)
+{
+    struct Env *e;
+
+    spin_lock(&sched_lock);
+    while ((e = sleepq) && e->env_wakeup <= now) {
+        // Still on its way into env_block; try again next tick.
+        if (e->env_status == ENV_RUNNING)
+            break;
+        sched_unsleep(e);
+        if (e->env_status == ENV_NOT_RUNNABLE) {
+            e->env_status = ENV_RUNNABLE;
+            sched_enqueue(e);
+        }
+    }
+    spin_unlock(&sched_lock);
+}
+
+// Pop the next env to run from rq, or return NULL if rq is empty.
+// Normally that is the head of the highest-priority non-empty list,
+// but the head of a lower list that has been passed over more than
+// SCHED_STARVE_LIMIT times is aged ahead of it.
+static struct Env *
+runq_pop(struct RunQueue *rq)
+{
+    struct Env *e = NULL, *h;
+    int p;
+
+    for (p = 0; p < NENVPRIO; p++) {
+        if (!(h = rq->rq_prio[p].rl_head))
+            continue;
+        if (!e)
+            e = h;
+        else if (rq->rq_clock - h->env_rq_stamp > SCHED_STARVE_LIMIT) {
+            e = h;
             break;
         }
-    }	
+    }
+
+    if (e) {
+        sched_dequeue(e);
+        rq->rq_clock++;
+    }
+    return e;
+}
+
+// This CPU has run out of work: find the busiest other CPU, starting
+// with our nearest neighbour, and migrate half of its queue to ours.
+// Envs are taken from the tail of each priority list, highest
+// priority first.  The tail holds the most recently queued envs: the
+// ones the victim would run last, so it keeps those it is about to run.
+// Returns the number of envs stolen.
+static int
+runq_steal(void)
+{
+    struct RunQueue *rq = &runqs[cpunum()];
+    struct RunQueue *victim = NULL;
+    struct Env *e;
+    int i, n, p;
+
+    for (i = 1; i < ncpu; i++) {
+        struct RunQueue *q = &runqs[(cpunum() + i) % ncpu];
+        if (q->rq_len > 0 && (!victim || q->rq_len > victim->rq_len))
+            victim = q;
+    }
+    if (!victim)
+        return 0;
+
+    n = (victim->rq_len + 1) / 2;
+    for (i = 0, p = 0; i < n; i++) {
+        while (!victim->rq_prio[p].rl_tail)
+            p++;
+        e = victim->rq_prio[p].rl_tail;
+        sched_dequeue(e);
+        runq_append(rq, e);
+    }
+    return n;
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	// Round-robin within each priority level of this CPU's run queue:
+	// envs that stop running are appended at the tail by env_run(), so
+	// taking the head picks the env that has waited longest.  Higher
+	// priority levels go first, with aging to prevent starvation (see
+	// runq_pop).  The queue only ever
+	// holds ENV_RUNNABLE envs, so nothing running on another CPU can
+	// be chosen here.
+	//
+	// If this CPU's queue is empty, steal work from the busiest other
+	// CPU rather than going idle.  If no envs are runnable, but
+	// the environment previously running on this CPU is still
+	// ENV_RUNNING, it's okay to choose that environment.  Otherwise
+	// drop through to the code below to halt the cpu.
+    struct Env *e;
+
+    spin_lock(&sched_lock);
+
+    // curenv was destroyed by another CPU while it ran here.  Now that
+    // it is off the CPU for good, it is ours to free.
+    if (curenv && curenv->env_status == ENV_DYING) {
+        spin_unlock(&sched_lock);
+        spin_lock(&env_table_lock);
+        env_free(curenv);
+        spin_unlock(&env_table_lock);
+        curenv = NULL;
+        spin_lock(&sched_lock);
+    }
+
+    e = runq_pop(&runqs[cpunum()]);
+    if (!e && runq_steal())
+        e = runq_pop(&runqs[cpunum()]);
+
+    if (e)
+        env_run(e);
 
     // case: env status is RUNNING
     if (curenv && curenv->env_status == ENV_RUNNING) {
@@ -53,6 +296,7 @@ sched_yield(void)
 
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
+// Called with sched_lock held.
 //
 void
 sched_halt(void)
@@ -67,7 +311,8 @@ sched_halt(void)
 		     envs[i].env_status == ENV_DYING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == NENV && !sleepq) {
+		spin_unlock(&sched_lock);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -78,12 +323,17 @@ sched_halt(void)
 	lcr3(PADDR(kern_pgdir));
 
 	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// timer interupts come in, we know we came from sched_halt
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	spin_unlock(&sched_lock);
+
+	// Nothing to run: zero some pages for later page_alloc(ALLOC_ZERO)s.
+	page_zero_refill(SCHED_ZERO_REFILL);
+
+	// A shootdown whose IPI came in with interrupts off would never be
+	// seen again once we halt, and its sender would wait forever.
+	tlb_shootdown_poll();
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -6,7 +6,16 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_priority(struct Env *e, int priority);
+void sched_sleep(struct Env *e, uint32_t wakeup);
+void sched_unsleep(struct Env *e);
+void sched_wakeup(uint32_t now);
+
 #endif	// !JOS_KERN_SCHED_H
@@ -8,13 +8,27 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+// Kernel locks.  A CPU that needs more than one of them must acquire
+// them in this order, or risk deadlock:
+//
+//   env_table_lock  env_free_list, envid lookups and env lifetimes
+//   env_lock(e)     e's address space and IPC receive state; threads
+//                   share one; with two, take the lower-numbered first
+//   sched_lock      the run queues and every env's env_status
+//   page_lock       page_free_list and pp_ref
+//   cons_lock       console input buffer and output
+//
+// Interrupts are always disabled in the kernel, so a lock can never be
+// re-entered by a handler on the CPU holding it.
+struct spinlock env_table_lock = SPINLOCK_INIT(env_table_lock);
+struct spinlock sched_lock = SPINLOCK_INIT(sched_lock);
+struct spinlock page_lock = SPINLOCK_INIT(page_lock);
+struct spinlock cons_lock = SPINLOCK_INIT(cons_lock);
+
+// Every lock that has ever been acquired, linked through stat_link.
+static struct spinlock *stat_locks;
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -39,16 +53,16 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->owner != lock->next && lock->cpu == thiscpu;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	lk->next = lk->owner = 0;
 	lk->name = name;
+#ifdef DEBUG_SPINLOCK
 	lk->cpu = 0;
 #endif
 }
@@ -60,17 +74,41 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
+	uint64_t start, now;
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
-		//panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
-        return;
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// Take a ticket and wait for our turn.  The xadd is atomic and
+	// serializes, so that reads after acquire are not reordered
+	// before it.  Waiters only read 'owner', so the line bounces
+	// once per hand-off rather than on every spin.  The holder may
+	// be waiting for us to flush our TLB, so do that while we wait.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+		start = read_tsc();
+		while (lk->owner != ticket) {
+			tlb_shootdown_poll();
+			asm volatile ("pause");
+		}
+		now = read_tsc();
+		lk->contended++;
+		lk->spin_cycles += now - start;
+	} else
+		now = read_tsc();
+
+	lk->acquires++;
+	lk->hold_start = now;
+	if (!lk->stat_listed) {
+		// Readers may briefly see the list end here; that's fine
+		// for statistics.
+		lk->stat_listed = 1;
+		lk->stat_link = (struct spinlock *)
+			xchg((uint32_t *) &stat_locks, (uint32_t) lk);
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -108,14 +146,35 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
+	uint64_t held = read_tsc() - lk->hold_start;
+	if (held > lk->hold_max)
+		lk->hold_max = held;
+
+	// Hand the lock to the next ticket.  Only the holder writes
+	// 'owner'.  The xchg serializes, so that reads before release
+	// are not reordered after it.  The 1996 PentiumPro manual
+	// (Volume 3, 7.2) says reads can be carried out speculatively
+	// and in any order, which implies we need to serialize here.
 	// The xchg being asm volatile ensures gcc emits it after
 	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	xchg(&lk->owner, lk->owner + 1);
+}
+
+// Return the list of locks that have been acquired at least once,
+// linked through stat_link, for the lockstat monitor command.
+struct spinlock *
+spin_stats_list(void)
+{
+	return stat_locks;
+}
+
+// Zero the contention statistics of every lock.  Racy against
+// concurrent acquires, which is fine for a monitor command.
+void
+spin_stats_reset(void)
+{
+	struct spinlock *lk;
+
+	for (lk = stat_locks; lk; lk = lk->stat_link)
+		lk->acquires = lk->contended = lk->spin_cycles = lk->hold_max = 0;
 }
@@ -6,13 +6,24 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
-// Mutual exclusion lock.
+// Mutual exclusion lock.  A ticket lock: CPUs are let in in the order
+// they arrived, and each one spins on 'owner' only.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;    // Next ticket to hand out
+	volatile uint32_t owner;   // Ticket of the CPU allowed in
+	char *name;            // Name of lock.
+
+	// Contention statistics, updated by the holder (see mon_lockstat)
+	struct spinlock *stat_link;    // Next lock in spin_stats_list()
+	bool stat_listed;      // Is this lock on that list yet?
+	uint64_t acquires;     // Times acquired
+	uint64_t contended;    // Acquisitions that had to wait
+	uint64_t spin_cycles;  // TSC cycles spent waiting, in total
+	uint64_t hold_max;     // Longest time held, in TSC cycles
+	uint64_t hold_start;   // TSC when last acquired
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
@@ -22,27 +33,18 @@ struct spinlock {
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+struct spinlock *spin_stats_list(void);
+void spin_stats_reset(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// Static initializer for a named lock.
+#define SPINLOCK_INIT(lock)	{ .name = #lock }
+
+// See kern/spinlock.c for what each lock protects and the lock order.
+extern struct spinlock env_table_lock;
+extern struct spinlock sched_lock;
+extern struct spinlock page_lock;
+extern struct spinlock cons_lock;
 
 #endif
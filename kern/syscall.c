@@ -13,6 +13,27 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/spinlock.h>
+
+// Copy len bytes between the kernel and curenv's memory at uva, which
+// must allow perm.  The range is checked and copied under curenv's
+// lock, so a thread sharing the address space can't unmap it in
+// between.  Destroys curenv if the range is bad.
+static void
+user_copy(void *kva, void *uva, size_t len, int perm, bool out)
+{
+    env_lock(curenv);
+    while (user_mem_check(curenv, uva, len, perm | PTE_U | PTE_P) < 0) {
+        env_unlock(curenv);
+        user_mem_assert(curenv, uva, len, perm);     // may not return
+        env_lock(curenv);
+    }
+    if (out)
+        memmove(uva, kva, len);
+    else
+        memmove(kva, uva, len);
+    env_unlock(curenv);
+}
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -20,14 +41,22 @@
 static void
 sys_cputs(const char *s, size_t len)
 {
+    char buf[256];
+    size_t n;
+
 	// Check that the user has permission to read memory [s, s+len).
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
     user_mem_assert(curenv, s, len, PTE_U | PTE_P);
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Print the string supplied by the user, a kernel copy of a
+	// piece at a time.
+    for (; len > 0; s += n, len -= n) {
+        n = MIN(len, sizeof(buf));
+        user_copy(buf, (void *) s, n, 0, false);
+        cprintf("%.*s", n, buf);
+    }
 }
 
 // Read a character from the system console without blocking.
@@ -45,6 +74,25 @@ sys_getenvid(void)
 	return curenv->env_id;
 }
 
+// As envid2env with checkperm set, except that curenv may also get at
+// an env it is the pager of while that env waits on it for a page,
+// and if va is given, only for the page at va.  This is all a pager
+// needs to page an env in, or to destroy it if it can't.
+static int
+envid2env_pager(envid_t envid, struct Env **env_store, void *va)
+{
+    struct Env *e;
+
+    if (envid2env(envid, env_store, 1) == 0)
+        return 0;
+    if (envid2env(envid, &e, 0) == 0 && e->env_pager == curenv->env_id
+        && e->env_pager_va && (!va || e->env_pager_va == (uintptr_t) va)) {
+        *env_store = e;
+        return 0;
+    }
+    return -E_BAD_ENV;
+}
+
 // Destroy a given environment (possibly the currently running environment).
 //
 // Returns 0 on success, < 0 on error.  Errors are:
@@ -56,12 +104,57 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	spin_lock(&env_table_lock);
+	if ((r = envid2env_pager(envid, &e, NULL)) < 0) {
+		spin_unlock(&env_table_lock);
 		return r;
-	env_destroy(e);
+	}
+	env_reclaim(e);
+	spin_unlock(&env_table_lock);
+
+	if (e == curenv) {
+		curenv = NULL;
+		sched_yield();
+	}
 	return 0;
 }
 
+// Give up the CPU until some other env makes curenv runnable again.
+// Called with curenv's env_lock held: whoever wakes curenv must take
+// that lock first, so it cannot be run on another CPU before this one
+// has let go of it.  Does not return.
+static void env_block(void) __attribute__((noreturn));
+
+static void
+env_block(void)
+{
+    struct Env *e = curenv;
+
+    spin_lock(&sched_lock);
+    if (e->env_status == ENV_DYING) {
+        // Destroyed meanwhile; sched_yield frees it.
+        spin_unlock(&sched_lock);
+        env_unlock(e);
+        sched_yield();
+    }
+    e->env_status = ENV_NOT_RUNNABLE;
+    spin_unlock(&sched_lock);
+
+    curenv = NULL;
+    lcr3(PADDR(kern_pgdir));
+    env_unlock(e);
+    sched_yield();
+}
+
+// Block in a system call, which returns 0 once curenv is woken up.
+// As for env_block.
+static void
+sys_block(void)
+{
+    curenv->env_tf.tf_regs.reg_eax = 0;
+    env_block();
+}
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -69,6 +162,17 @@ sys_yield(void)
 	sched_yield();
 }
 
+// Children, forked or not, start with their parent's pager.  spawn
+// sets the pager of the children it loads.
+static void
+env_inherit_pager(struct Env *child, struct Env *parent)
+{
+    child->env_pager = parent->env_pager;
+    child->env_pager_start = parent->env_pager_start;
+    child->env_pager_end = parent->env_pager_end;
+    child->env_pager_arg = parent->env_pager_arg;
+}
+
 // Allocate a new environment.
 // Returns envid of new environment, or < 0 on error.  Errors are:
 //	-E_NO_FREE_ENV if no free environment is available.
@@ -85,16 +189,190 @@ sys_exofork(void)
 	// LAB 4: Your code here.
 
     struct Env *env;
+    spin_lock(&env_table_lock);
     int rtn = env_alloc(&env, curenv->env_id);
+    spin_unlock(&env_table_lock);
     if (rtn < 0) return rtn;
 
-    env->env_status = ENV_NOT_RUNNABLE;
+    env_inherit_pager(env, curenv);
     memmove(&env->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
     env->env_tf.tf_regs.reg_eax = 0;
 
     return env->env_id;
 }
 
+// Give child a copy-on-write copy of curenv's address space below UTOP.
+// Writable and copy-on-write pages become copy-on-write in both, and
+// pages marked PTE_SHARE and read-only pages are shared as they are.
+// 4MB pages can't be copy-on-write, so writable ones that aren't
+// PTE_SHARE are copied outright.  The child gets a fresh exception stack.  If share is
+// set, the child is a thread instead: it shares every page table but
+// the one for ENV_PRIVATE_PDX, which alone is copied.  Both envs must
+// be locked.  Returns 0 or -E_NO_MEM.
+static int
+fork_copy_mappings(struct Env *child, bool share)
+{
+    pde_t *src = curenv->env_pgdir;
+    pte_t *pt;
+    struct PageInfo *pp;
+    uint32_t pdx, ptx;
+    void *va;
+    int perm, rtn = 0;
+
+    // Invalidate the parent's newly read-only entries all at once.
+    tlb_batch_begin();
+    for (pdx = 0; pdx < PDX(UTOP) && rtn == 0; pdx++) {
+        if (!(src[pdx] & PTE_P))
+            continue;
+
+        if (share && pdx != ENV_PRIVATE_PDX) {
+            spin_lock(&page_lock);
+            pa2page(PTE_ADDR(src[pdx]))->pp_ref++;
+            spin_unlock(&page_lock);
+            child->env_pgdir[pdx] = src[pdx];
+            continue;
+        }
+
+        if (src[pdx] & PTE_PS) {
+            pp = pa2page(PTE_ADDR(src[pdx]));
+            if ((src[pdx] & (PTE_W | PTE_SHARE)) == PTE_W) {
+                struct PageInfo *copy = page_alloc_order(PAGE_LARGE_ORDER, 0);
+                if (!copy) {
+                    rtn = -E_NO_MEM;
+                    continue;
+                }
+                memmove(page2kva(copy), page2kva(pp), PTSIZE);
+                pp = copy;
+            }
+            rtn = page_insert_large(child->env_pgdir, pp, PGADDR(pdx, 0, 0), src[pdx] & PTE_SYSCALL);
+            continue;
+        }
+
+        pt = KADDR(PTE_ADDR(src[pdx]));
+        for (ptx = 0; ptx < NPTENTRIES && rtn == 0; ptx++) {
+            if (!(pt[ptx] & PTE_P))
+                continue;
+            va = PGADDR(pdx, ptx, 0);
+            if (va == (void *) (UXSTACKTOP - PGSIZE))
+                continue;
+
+            perm = pt[ptx] & PTE_SYSCALL;
+            if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+                perm = (perm | PTE_COW) & ~PTE_W;
+                pt[ptx] = (pt[ptx] | PTE_COW) & ~PTE_W;
+                tlb_invalidate(src, va);
+            }
+            rtn = page_insert(child->env_pgdir, pa2page(PTE_ADDR(pt[ptx])), va, perm);
+        }
+    }
+    tlb_batch_end();
+    if (rtn < 0)
+        return rtn;
+
+    if (page_lookup(src, (void *) (UXSTACKTOP - PGSIZE), NULL)) {
+        if (!(pp = page_alloc(ALLOC_ZERO)))
+            return -E_NO_MEM;
+        if ((rtn = page_insert(child->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P)) < 0) {
+            page_free(pp);
+            return rtn;
+        }
+    }
+    return 0;
+}
+
+// Fork curenv in the kernel: create a child whose address space is a
+// copy-on-write copy of curenv's, with the same registers, page fault
+// upcall and priority, and make it runnable.  Write faults on the
+// copy-on-write pages are resolved by page_fault_handler.
+//
+// Returns the child's envid to the parent and 0 to the child, or < 0
+// on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+    struct Env *env;
+    int rtn;
+
+    spin_lock(&env_table_lock);
+    if ((rtn = env_alloc(&env, curenv->env_id)) < 0) {
+        spin_unlock(&env_table_lock);
+        return rtn;
+    }
+    env_lock_pair(curenv, env);
+    spin_unlock(&env_table_lock);
+
+    rtn = fork_copy_mappings(env, false);
+    env_unlock_pair(curenv, env);
+    if (rtn < 0) {
+        spin_lock(&env_table_lock);
+        env_free(env);
+        spin_unlock(&env_table_lock);
+        return rtn;
+    }
+
+    env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    env_inherit_pager(env, curenv);
+    memmove(&env->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
+    env->env_tf.tf_regs.reg_eax = 0;
+
+    spin_lock(&sched_lock);
+    env->env_status = ENV_RUNNABLE;
+    sched_enqueue(env);
+    spin_unlock(&sched_lock);
+
+    return env->env_id;
+}
+
+// Create a thread: like sys_fork, but the child shares curenv's
+// address space, except for the top page table, which holds the stacks
+// and is copied on write as in sys_fork.  So each thread has its own
+// stack and exception stack at the usual addresses, while everything
+// else, including mappings made later by either, is shared.
+//
+// Returns the child's envid to the parent and 0 to the child, or < 0
+// on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_sfork(void)
+{
+    struct Env *env;
+    int rtn;
+
+    spin_lock(&env_table_lock);
+    if ((rtn = env_alloc(&env, curenv->env_id)) < 0) {
+        spin_unlock(&env_table_lock);
+        return rtn;
+    }
+    env->env_vmid = curenv->env_vmid;
+    env_lock(curenv);
+    spin_unlock(&env_table_lock);
+
+    curenv->env_vmshared = env->env_vmshared = true;
+    rtn = fork_copy_mappings(env, true);
+    env_unlock(curenv);
+    if (rtn < 0) {
+        spin_lock(&env_table_lock);
+        env_free(env);
+        spin_unlock(&env_table_lock);
+        return rtn;
+    }
+
+    env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    env_inherit_pager(env, curenv);
+    memmove(&env->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
+    env->env_tf.tf_regs.reg_eax = 0;
+
+    spin_lock(&sched_lock);
+    env->env_status = ENV_RUNNABLE;
+    sched_enqueue(env);
+    spin_unlock(&sched_lock);
+
+    return env->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -115,24 +393,80 @@ sys_env_set_status(envid_t envid, int status)
 
     struct Env *env;
     int rtn;
-    
+
+    if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE) {
+        cprintf("sys_env_set_status: invalid status\n");
+        return -E_INVAL;
+    }
+
+    spin_lock(&env_table_lock);
     rtn = envid2env(envid, &env, 1);
     if (rtn < 0) {
+        spin_unlock(&env_table_lock);
         cprintf("sys_env_set_status: envid2env\n");
         return rtn;
     }
-
-    if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE) {
-        cprintf("sys_env_set_status: invalid status\n");
-        return -E_INVAL;
+    env_lock(env);
+    spin_unlock(&env_table_lock);
+
+    if (env == curenv && status == ENV_NOT_RUNNABLE)
+        sys_block();
+
+    spin_lock(&sched_lock);
+    if (env->env_status == ENV_DYING) {
+        rtn = -E_BAD_ENV;
+    } else if (env->env_status == ENV_RUNNING) {
+        // Already running; only the env itself may stop that.
+        if (status == ENV_NOT_RUNNABLE)
+            rtn = -E_INVAL;
+    } else {
+        env->env_status = status;
+        sched_unsleep(env);
+        if (status == ENV_RUNNABLE)
+            sched_enqueue(env);
+        else
+            sched_dequeue(env);
     }
-    
-    env->env_status = status;
-    return 0;
+    spin_unlock(&sched_lock);
+    env_unlock(env);
+    return rtn;
 
 	//panic("sys_env_set_status not implemented");
 }
 
+// Set envid's scheduling priority to 'priority', one of the ENV_PRIO_*
+// values in inc/env.h.  Only system servers, and environments they
+// have raised, may raise an environment above ENV_PRIO_NORMAL.
+// Children start at ENV_PRIO_NORMAL whatever their parent's priority.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is not a valid priority, or is higher than
+//		the caller is allowed to grant.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+    struct Env *env;
+    int rtn;
+
+    if (priority < 0 || priority >= NENVPRIO)
+        return -E_INVAL;
+
+    if (priority < ENV_PRIO_NORMAL && priority < curenv->env_priority
+        && curenv->env_type == ENV_TYPE_USER)
+        return -E_INVAL;
+
+    spin_lock(&env_table_lock);
+    if ((rtn = envid2env(envid, &env, 1)) == 0) {
+        spin_lock(&sched_lock);
+        sched_set_priority(env, priority);
+        spin_unlock(&sched_lock);
+    }
+    spin_unlock(&env_table_lock);
+    return rtn;
+}
+
 // Set envid's trap frame to 'tf'.
 // tf is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3) with interrupts enabled.
@@ -147,19 +481,22 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// Remember to check whether the user has supplied us with a good
 	// address!
     int r;
-	struct Env *e;
+    struct Env *e;
+    struct Trapframe ktf;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
-		return r;
-
-    if (tf->tf_eip >= UTOP)
+    user_copy(&ktf, tf, sizeof(ktf), 0, false);
+    if (ktf.tf_eip >= UTOP)
         return -1;
 
-    e->env_tf = *tf;
-    e->env_tf.tf_eflags |= FL_IF;
-    e->env_tf.tf_cs |= 0x03;
+    spin_lock(&env_table_lock);
+    if ((r = envid2env(envid, &e, 1)) == 0) {
+        e->env_tf = ktf;
+        e->env_tf.tf_eflags |= FL_IF;
+        e->env_tf.tf_cs |= 0x03;
+    }
+    spin_unlock(&env_table_lock);
 
-    return 0;
+    return r;
 }
 
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
@@ -177,16 +514,126 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
     struct Env *env;
     int rtn;
     
+    spin_lock(&env_table_lock);
     rtn = envid2env(envid, &env, 1);
-    if (rtn < 0) {
+    if (rtn == 0)
+        env->env_pgfault_upcall = func;
+    spin_unlock(&env_table_lock);
+    if (rtn < 0)
         cprintf("sys_env_set_status: envid2env\n");
-        return rtn;
+    return rtn;
+
+	// panic("sys_env_set_pgfault_upcall not implemented");
+}
+
+// Make 'pager' the pager of envid for faults on not-present pages in
+// [start, end): rather than go to envid's page fault upcall, such a
+// fault blocks envid and is sent to the pager as an IPC (see
+// IPC_PGFAULT in inc/env.h).  The pager may then map pages into envid,
+// make it runnable again, or destroy it, just as envid's parent could.
+// 'arg' is stored in env_pager_arg for the pager to read.  A pager of 0
+// turns this off.  Children inherit their parent's pager.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if start or end is not page-aligned or is above UTOP.
+static int
+sys_env_set_pager(envid_t envid, envid_t pager, uintptr_t start,
+                  uintptr_t end, uint32_t arg)
+{
+    struct Env *env;
+    int rtn;
+
+    if (start % PGSIZE || end % PGSIZE || start > UTOP || end > UTOP)
+        return -E_INVAL;
+
+    spin_lock(&env_table_lock);
+    rtn = envid2env(envid, &env, 1);
+    if (rtn == 0) {
+        env->env_pager = pager;
+        env->env_pager_start = start;
+        env->env_pager_end = end;
+        env->env_pager_arg = arg;
     }
+    spin_unlock(&env_table_lock);
+    return rtn;
+}
 
-    env->env_pgfault_upcall = func;
-    return 0;
+// Pass a fault by curenv on the not-present page at fault_va to its
+// pager, if it has one for that address, and block until the pager is
+// done.  If the pager is not waiting in sys_ipc_recv, curenv just
+// yields and will fault again; env_pager_va lets a busy pager see
+// what curenv is waiting for.  Returns false, having done nothing, if
+// the fault is not for a pager, and true if the page turns out to be
+// mapped already, so curenv can just retry.
+bool
+pager_fault(uint32_t fault_va)
+{
+    struct Env *e = curenv, *pager;
 
-	// panic("sys_env_set_pgfault_upcall not implemented");
+    if (!e->env_pager || fault_va < e->env_pager_start
+        || fault_va >= e->env_pager_end)
+        return false;
+
+    spin_lock(&env_table_lock);
+    if (envid2env(e->env_pager, &pager, 0) < 0
+        || ENVX(pager->env_vmid) == ENVX(e->env_vmid)) {
+        spin_unlock(&env_table_lock);
+        return false;
+    }
+    env_lock_pair(e, pager);
+    spin_unlock(&env_table_lock);
+
+    // A thread sharing e's page tables may have faulted on the same
+    // page, and had it paged in since; paging it in again would replace
+    // whatever has been written to it.
+    if (page_lookup_large(e->env_pgdir, (void *) fault_va, NULL)
+        || page_lookup(e->env_pgdir, (void *) fault_va, NULL)) {
+        env_unlock_pair(e, pager);
+        return true;
+    }
+
+    e->env_pager_va = ROUNDDOWN(fault_va, PGSIZE);
+    if (!pager->env_ipc_recving) {
+        env_unlock_pair(e, pager);
+        sched_yield();
+    }
+
+    pager->env_ipc_from = e->env_id;
+    pager->env_ipc_value = ROUNDDOWN(fault_va, PGSIZE) | IPC_PGFAULT;
+    pager->env_ipc_perm = 0;
+    pager->env_ipc_npages = 0;
+    pager->env_ipc_recving = 0;
+    pager->env_tf.tf_regs.reg_eax = 0;
+
+    spin_lock(&sched_lock);
+    if (pager->env_status != ENV_DYING) {
+        pager->env_status = ENV_RUNNABLE;
+        sched_enqueue(pager);
+    }
+    spin_unlock(&sched_lock);
+    env_unlock(pager);
+
+    env_block();
+}
+
+// A page was just mapped at va in e: bring threads sharing its page
+// tables up to date, and if e was blocked on a fault there waiting
+// for its pager, resume it.  Called with e's env_lock held.
+static void
+page_mapped(struct Env *e, void *va)
+{
+    env_vm_sync(e, va);
+    if (e->env_pager_va == (uintptr_t) va) {
+        e->env_pager_va = 0;
+        spin_lock(&sched_lock);
+        if (e->env_status == ENV_NOT_RUNNABLE) {
+            e->env_status = ENV_RUNNABLE;
+            sched_enqueue(e);
+        }
+        spin_unlock(&sched_lock);
+    }
 }
 
 // Allocate a page of memory and map it at 'va' with permission
@@ -197,12 +644,19 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         As an exception, PTE_PS asks for a zeroed 4MB page at the
+//         PTSIZE-aligned 'va'.  Large pages can be passed on with
+//         sys_page_map, but not piecemeal; fork copies writable ones.
+//         PTE_COW without PTE_W maps the shared zero page instead of
+//         allocating; the first write gets a private zeroed page.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if PTE_PS is set and 4KB pages are already mapped in
+//		[va, va+PTSIZE), or the CPU has no 4MB pages.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -219,12 +673,6 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     struct Env *env;
     int rtn;
     
-    rtn = envid2env(envid, &env, 1);
-    if (rtn < 0) {
-        cprintf("sys_page_alloc: envid2env\n");
-        return rtn;
-    }
-
     if ((uint32_t)va >= UTOP || (uint32_t)va % PGSIZE != 0) {
         cprintf("sys_page_alloc: invalid boundary\n");
         return -E_INVAL;
@@ -235,20 +683,62 @@ sys_page_alloc(envid_t envid, void *va, int perm)
         return -E_INVAL;
     }
 
-    if ((perm & ~PTE_SYSCALL) != 0) {
+    if ((perm & ~(PTE_SYSCALL | PTE_PS)) != 0) {
         cprintf("sys_page_alloc: invalid perm\n");
         return -E_INVAL;
     }
+
+    int order = 0;
+    if (perm & PTE_PS) {
+        if (!pse_supported)
+            return -E_INVAL;
+        perm &= ~PTE_PS;
+        order = PAGE_LARGE_ORDER;
+        if ((uint32_t)va % PTSIZE != 0 || (uint32_t)va + PTSIZE > UTOP)
+            return -E_INVAL;
+    }
     
-    struct PageInfo *pp = page_alloc(ALLOC_ZERO);
+    if (!order && (perm & (PTE_COW | PTE_W)) == PTE_COW) {
+        spin_lock(&env_table_lock);
+        rtn = envid2env_pager(envid, &env, va);
+        if (rtn < 0) {
+            spin_unlock(&env_table_lock);
+            return rtn;
+        }
+        env_lock(env);
+        spin_unlock(&env_table_lock);
+        if ((rtn = page_insert_zero(env->env_pgdir, va, perm)) == 0)
+            page_mapped(env, va);
+        env_unlock(env);
+        return rtn;
+    }
+
+    struct PageInfo *pp = page_alloc_order(order, ALLOC_ZERO);
     if (!pp) {
         cprintf("sys_page_alloc: page_alloc\n");
         return -E_NO_MEM;
     }
 
-    rtn = page_insert(env->env_pgdir, pp, va, perm);
+    spin_lock(&env_table_lock);
+    rtn = envid2env_pager(envid, &env, va);
+    if (rtn < 0) {
+        spin_unlock(&env_table_lock);
+        page_free_order(pp, order);
+        cprintf("sys_page_alloc: envid2env\n");
+        return rtn;
+    }
+    env_lock(env);
+    spin_unlock(&env_table_lock);
+
+    if (order)
+        rtn = page_insert_large(env->env_pgdir, pp, va, perm);
+    else
+        rtn = page_insert(env->env_pgdir, pp, va, perm);
+    if (rtn == 0)
+        page_mapped(env, va);
+    env_unlock(env);
     if (rtn < 0) {
-        page_free(pp);
+        page_free_order(pp, order);
         cprintf("sys_page_alloc: page_insert\n");
         return rtn;
     }
@@ -257,6 +747,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	//panic("sys_page_alloc not implemented");
 }
 
+static int
+page_map_locked(struct Env *se, void *srcva, struct Env *de, void *dstva, int perm);
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -286,13 +779,29 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	// LAB 4: Your code here.
     struct Env *se, *de;
+    int rtn;
 
+    spin_lock(&env_table_lock);
     if (envid2env(srcenvid, &se, 1) 
-            || envid2env(dstenvid, &de, 1)) {
+            || envid2env_pager(dstenvid, &de, dstva)) {
+        spin_unlock(&env_table_lock);
         cprintf("sys_page_map: E_BAD_ENV\n");
         return -E_BAD_ENV;        
     }
+    env_lock_pair(se, de);
+    spin_unlock(&env_table_lock);
 
+    rtn = page_map_locked(se, srcva, de, dstva, perm);
+
+    env_unlock_pair(se, de);
+    return rtn;
+	// panic("sys_page_map not implemented");
+}
+
+// The body of sys_page_map, once se and de are looked up and locked.
+static int
+page_map_locked(struct Env *se, void *srcva, struct Env *de, void *dstva, int perm)
+{
     if ((uint32_t)srcva >= UTOP
             || (uint32_t)dstva >= UTOP
             || (uint32_t)srcva % PGSIZE != 0
@@ -312,27 +821,113 @@ sys_page_map(envid_t srcenvid, void *srcva,
         return -E_INVAL;
     }
     */
-    
+
     pte_t *pte;
-    struct PageInfo *pp = page_lookup(se->env_pgdir, srcva, &pte);
-    if (!pp) {
+    int rtn;
+    struct PageInfo *pp;
+
+    if ((pp = page_lookup_large(se->env_pgdir, srcva, &pte))) {
+        // A 4MB page can only be mapped whole.
+        if ((uint32_t)srcva % PTSIZE != 0 || (uint32_t)dstva % PTSIZE != 0)
+            rtn = -E_INVAL;
+        else if ((perm & PTE_W) && !(*pte & PTE_W))
+            rtn = -E_INVAL;
+        else
+            rtn = page_insert_large(de->env_pgdir, pp, dstva,
+                                    perm & ~PTE_PS);
+    } else if (!(pp = page_lookup(se->env_pgdir, srcva, &pte))) {
         cprintf("sys_page_map: map not found\n");    
-        return -E_INVAL;
+        rtn = -E_INVAL;
+    } else if ((perm & PTE_W) && !(*pte & PTE_W)) {
+        cprintf("sys_page_map: invalid PTE_W\n");
+        rtn = -E_INVAL;
+    } else if ((rtn = page_insert(de->env_pgdir, pp, dstva, perm)) < 0) {
+        cprintf("sys_page_map: page_insert\n");
     }
 
-    if ((perm & PTE_W) && !(*pte & PTE_W)) {
-        cprintf("sys_page_map: invalid PTE_W\n");
+    if (rtn == 0)
+        page_mapped(de, dstva);
+    return rtn;
+}
+
+// Apply n sys_page_map operations from the array ops, in order, in a
+// single system call.  An operation with pm_perm 0 instead unmaps
+// pm_dstva in pm_dstenv, like sys_page_unmap.  Consecutive operations
+// on the same pair of environments share one lookup and locking of
+// those environments, and one round of TLB shootdowns.  The operations
+// are copied into the kernel a chunk at a time before any of that chunk
+// is applied, since one of them may unmap the page holding the rest.
+//
+// Returns 0 if every operation succeeds.  Otherwise stops at the first
+// failure, leaving the operations before it applied, and returns that
+// failure's error code (see sys_page_map).
+#define PAGEMAP_CHUNK 32
+
+static int
+sys_page_map_batch(const struct PageMapOp *ops, int n)
+{
+    struct PageMapOp kops[PAGEMAP_CHUNK];
+    struct Env *se = NULL, *de = NULL;
+    envid_t srcenvid = 0, dstenvid = 0;
+    int i, nk, rtn = 0;
+
+    if (n < 0 || n > ULIM / sizeof(*ops))
         return -E_INVAL;
-    }
+    user_mem_assert(curenv, ops, n * sizeof(*ops), PTE_U | PTE_P);
+
+    for (i = 0; i < n && rtn == 0; i++) {
+        if (i % PAGEMAP_CHUNK == 0) {
+            if (se) {
+                tlb_batch_end();
+                env_unlock_pair(se, de);
+                se = de = NULL;
+            }
+            // Check and copy under curenv's lock, so that a thread
+            // sharing the address space can't unmap the ops in between.
+            nk = MIN(n - i, PAGEMAP_CHUNK);
+            env_lock(curenv);
+            if (user_mem_check(curenv, ops + i, nk * sizeof(*ops), PTE_U | PTE_P) < 0) {
+                env_unlock(curenv);
+                return -E_FAULT;
+            }
+            memmove(kops, ops + i, nk * sizeof(*ops));
+            env_unlock(curenv);
+        }
+        struct PageMapOp op = kops[i % PAGEMAP_CHUNK];
+
+        if (!se || op.pm_srcenv != srcenvid || op.pm_dstenv != dstenvid) {
+            if (se) {
+                tlb_batch_end();
+                env_unlock_pair(se, de);
+            }
+            spin_lock(&env_table_lock);
+            if (envid2env(op.pm_srcenv, &se, 1)
+                    || envid2env(op.pm_dstenv, &de, 1)) {
+                spin_unlock(&env_table_lock);
+                return -E_BAD_ENV;
+            }
+            env_lock_pair(se, de);
+            spin_unlock(&env_table_lock);
+            tlb_batch_begin();
+            srcenvid = op.pm_srcenv;
+            dstenvid = op.pm_dstenv;
+        }
 
-    int rtn = page_insert(de->env_pgdir, pp, dstva, perm);
-    if (rtn < 0) {
-        cprintf("sys_page_map: page_insert\n");
-        return rtn;
+        if (op.pm_perm != 0)
+            rtn = page_map_locked(se, op.pm_srcva, de, op.pm_dstva, op.pm_perm);
+        else if ((uint32_t) op.pm_dstva >= UTOP || (uint32_t) op.pm_dstva % PGSIZE != 0)
+            rtn = -E_INVAL;
+        else {
+            page_remove(de->env_pgdir, op.pm_dstva);
+            env_vm_sync(de, op.pm_dstva);
+        }
     }
 
-    return 0;
-	// panic("sys_page_map not implemented");
+    if (se) {
+        tlb_batch_end();
+        env_unlock_pair(se, de);
+    }
+    return rtn;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -351,18 +946,24 @@ sys_page_unmap(envid_t envid, void *va)
     struct Env *env;
     int rtn;
     
+    if ((uint32_t)va >= UTOP || (uint32_t)va % PGSIZE != 0) {
+        cprintf("sys_page_unmap: invalid boundary\n");
+        return -E_INVAL;
+    }
+
+    spin_lock(&env_table_lock);
     rtn = envid2env(envid, &env, 1);
     if (rtn < 0) {
+        spin_unlock(&env_table_lock);
         cprintf("sys_page_unmap: envid2env\n");
         return rtn;
     }
-
-    if ((uint32_t)va >= UTOP || (uint32_t)va % PGSIZE != 0) {
-        cprintf("sys_page_unmap: invalid boundary\n");
-        return -E_INVAL;
-    }
+    env_lock(env);
+    spin_unlock(&env_table_lock);
 
     page_remove(env->env_pgdir, va);
+    env_vm_sync(env, va);
+    env_unlock(env);
 
     return 0;
 	// panic("sys_page_unmap not implemented");
@@ -406,22 +1007,25 @@ sys_page_unmap(envid_t envid, void *va)
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//
+// 'npages' pages starting at srcva may be sent at once (0 means 1); the
+// receiver gets as many of them as it asked for in sys_ipc_recv, and
+// finds the number in env_ipc_npages.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+                 int npages)
 {
 	// LAB 4: Your code here.
-    int r;
+    int r, i, n;
     struct Env *env;
 
-    if ((r = envid2env(envid, &env, 0)) < 0) {
-        return r;
-    }
-    
-    if (!env->env_ipc_recving) {
-        return -E_IPC_NOT_RECV;
-    }
+    if (npages == 0)
+        npages = 1;
+    if (npages < 0 || npages > IPC_MAXPAGES)
+        return -E_INVAL;
 
-    if ((uint32_t)srcva < UTOP && (uint32_t)srcva % PGSIZE != 0) {
+    if ((uint32_t)srcva < UTOP && ((uint32_t)srcva % PGSIZE != 0
+            || (uint32_t)srcva + npages * PGSIZE > UTOP)) {
         cprintf("sys_ipc_try_send: invalid boundary\n");
         return -E_INVAL;
     }
@@ -434,20 +1038,50 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
         return -E_INVAL;
     }
 
+    spin_lock(&env_table_lock);
+    if ((r = envid2env(envid, &env, 0)) < 0) {
+        spin_unlock(&env_table_lock);
+        return r;
+    }
+    env_lock_pair(curenv, env);
+    spin_unlock(&env_table_lock);
+
+    if (!env->env_ipc_recving) {
+        env_unlock_pair(curenv, env);
+        return -E_IPC_NOT_RECV;
+    }
+
     // env->env_ipc_dstva >= UTOP indicating the received env doesn't want to receive a page mapping
+    env->env_ipc_npages = 0;
     if ((uint32_t)srcva < UTOP && (uint32_t)env->env_ipc_dstva < UTOP) {
 
-        struct PageInfo *pp = page_lookup(curenv->env_pgdir, srcva, 0);
-        if (!pp) {
-            return -E_INVAL;
+        pte_t *pte;
+        struct PageInfo *pp;
+        n = MIN(npages, env->env_ipc_npages_max);
+
+        // Check every page before mapping any.
+        for (i = 0; i < n; i++) {
+            pp = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, &pte);
+            if (!pp || ((perm & PTE_W) && !(*pte & PTE_W))) {
+                env_unlock_pair(curenv, env);
+                return -E_INVAL;
+            }
         }
 
-        r = page_insert(env->env_pgdir, pp, env->env_ipc_dstva, perm);
-        if (r < 0) {
-            cprintf("sys_ipc_try_send: page_insert %d %e\n", r, r);
+        for (i = 0; i < n; i++) {
+            void *dstva = env->env_ipc_dstva + i * PGSIZE;
+
+            pp = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, 0);
+            r = page_insert(env->env_pgdir, pp, dstva, perm);
+            if (r < 0) {
+                cprintf("sys_ipc_try_send: page_insert %d %e\n", r, r);
+                break;
+            }
+            env_vm_sync(env, dstva);
         }
 
         env->env_ipc_perm = perm;
+        env->env_ipc_npages = i;
     }
 
 //    env_ipc_recving is set to 0 to block future sends;
@@ -459,7 +1093,14 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     env->env_ipc_value = value;
     env->env_ipc_recving = 0;
     env->env_tf.tf_regs.reg_eax = 0;
-    env->env_status = ENV_RUNNABLE;
+
+    spin_lock(&sched_lock);
+    if (env->env_status != ENV_DYING) {
+        env->env_status = ENV_RUNNABLE;
+        sched_enqueue(env);
+    }
+    spin_unlock(&sched_lock);
+    env_unlock_pair(curenv, env);
 
     return 0;
 	// panic("sys_ipc_try_send not implemented");
@@ -472,24 +1113,34 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// Up to 'npages' pages (0 means 1) may then be mapped at dstva at once.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if npages is negative or above IPC_MAXPAGES, or the pages
+//		would run past UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, int npages)
 {
 	// LAB 4: Your code here.
+    if (npages == 0)
+        npages = 1;
+    if (npages < 0 || npages > IPC_MAXPAGES)
+        return -E_INVAL;
     if (dstva < (void *)UTOP &&
-            (uint32_t)dstva % PGSIZE) {
+            ((uint32_t)dstva % PGSIZE
+             || (uint32_t)dstva + npages * PGSIZE > UTOP)) {
         return -E_INVAL;
     }
 
+    env_lock(curenv);
     curenv->env_ipc_dstva = dstva;
+    curenv->env_ipc_npages_max = npages;
     curenv->env_ipc_perm = 0;
-    //curenv->env_tf.tf_regs.reg_eax = 0;
     curenv->env_ipc_recving = 1;
-    curenv->env_status = ENV_NOT_RUNNABLE;
+    sys_block();
 
 	return 0;
 }
@@ -502,22 +1153,46 @@ sys_time_msec(void)
     return time_msec();
 }
 
+// Block for at least msec milliseconds, rounded up to the next clock
+// tick, without using the CPU meanwhile.  Returns 0.
+static int
+sys_sleep(uint32_t msec)
+{
+    env_lock(curenv);
+    sched_sleep(curenv, time_msec() + MAX(msec, 1));
+    sys_block();
+    return 0;
+}
+
 static int
 sys_net_try_send(void *data, size_t len) 
 {
+    char buf[E1000_BUF_SIZE];
+
     if (data >= (void *)UTOP)
         return -E_INVAL;
+    if (len > sizeof(buf))
+        return -E_PKT_TOO_LONG;
 
-    return e1000_transmit(data, len);
+    user_copy(buf, data, len, 0, false);
+    return e1000_transmit(buf, len);
 }
 
 static int
 sys_net_try_receive(void *data, size_t *plen)
 {
+    char buf[E1000_BUF_SIZE];
+    uint32_t len;
+    int r;
+
     if (data >= (void *)UTOP)
         return -E_INVAL;
     
-    return e1000_receive(data, plen);
+    if ((r = e1000_receive(buf, &len)) < 0)
+        return r;
+    user_copy(buf, data, len, PTE_W, true);
+    user_copy(&len, plen, sizeof(*plen), PTE_W, true);
+    return 0;
 }
 
 // Dispatches to the correct kernel function, passing the arguments.
@@ -559,17 +1234,32 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
     case SYS_page_unmap:
         return sys_page_unmap((envid_t)a1, (void *)a2);
 
+    case SYS_fork:
+        return sys_fork();
+
+    case SYS_sfork:
+        return sys_sfork();
+
+    case SYS_page_map_batch:
+        return sys_page_map_batch((const struct PageMapOp *)a1, (int)a2);
+
     case SYS_env_set_status:
         return sys_env_set_status((envid_t)a1, (int)a2);
 
+    case SYS_env_set_priority:
+        return sys_env_set_priority((envid_t)a1, (int)a2);
+
     case SYS_env_set_pgfault_upcall:
         return sys_env_set_pgfault_upcall((envid_t)a1, (void *)a2);
 
+    case SYS_env_set_pager:
+        return sys_env_set_pager((envid_t)a1, (envid_t)a2, a3, a4, a5);
+
     case SYS_ipc_try_send:
-        return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4);
+        return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4, (int)a5);
 
     case SYS_ipc_recv:
-        return sys_ipc_recv((void *)a1);
+        return sys_ipc_recv((void *)a1, (int)a2);
 
     case SYS_env_set_trapframe:
         return sys_env_set_trapframe((envid_t)a1, (struct Trapframe *)a2);
@@ -577,6 +1267,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
     case SYS_time_msec:
         return sys_time_msec();
 
+    case SYS_sleep:
+        return sys_sleep(a1);
+
     case SYS_net_try_send:
         return sys_net_try_send((void *)a1, (size_t)a2);
 
@@ -584,7 +1277,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         return sys_net_try_receive((void *)a1, (size_t *)a2);
 
 	default:
-		return -E_INVAL;
+		return -E_NO_SYS;
 	}
 
     return 0;
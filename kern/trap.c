@@ -62,6 +62,8 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_TLBFLUSH)
+		return "TLB shootdown";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
@@ -193,6 +195,11 @@ trap_dispatch(struct Trapframe *tf)
     case T_BRKPT:
         monitor(tf);
         break;
+    case T_TLBFLUSH:
+        lapic_eoi();
+        tlb_shootdown_poll();
+        return;
+
     case T_SYSCALL:
         tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
                 tf->tf_regs.reg_edx,
@@ -230,7 +237,10 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 4: Your code here.
     if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
         lapic_eoi();
-        if (cpunum() == 0) time_tick();
+        if (cpunum() == 0) {
+            time_tick();
+            sched_wakeup(time_msec());
+        }
         sched_yield();
     }
         
@@ -274,10 +284,8 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We may have been halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -288,16 +296,17 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
 		assert(curenv);
-        lock_kernel();
 
-		// Garbage collect if current enviroment is a zombie
+		// Garbage collect if current enviroment is a zombie;
+		// sched_yield frees it.  Acknowledge a local APIC
+		// interrupt first, or it would stay in service, and carry
+		// out any shootdown, since the CPU asking waits for it.
 		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+			if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER
+			    || tf->tf_trapno == T_TLBFLUSH)
+				lapic_eoi();
+			tlb_shootdown_poll();
 			sched_yield();
 		}
 
@@ -319,13 +328,63 @@ trap(struct Trapframe *tf)
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
+	spin_lock(&sched_lock);
 	if (curenv && curenv->env_status == ENV_RUNNING)
 		env_run(curenv);
-	else
-		sched_yield();
+	spin_unlock(&sched_lock);
+	sched_yield();
 }
 
 
+// Resolve a user write fault on a copy-on-write page without a trip
+// to the user-level handler: give curenv its own writable copy, or just
+// make the page writable if nobody else maps it any more.  Returns true
+// if the fault was handled; false sends it down the usual upcall path.
+static bool
+cow_fault(uint32_t fault_va, uint32_t err)
+{
+    void *va = ROUNDDOWN((void *) fault_va, PGSIZE);
+    struct PageInfo *pp, *np;
+    pte_t *pte;
+    int perm;
+    bool done = false;
+
+    if ((err & (FEC_PR | FEC_WR)) != (FEC_PR | FEC_WR) || fault_va >= UTOP)
+        return false;
+
+    env_lock(curenv);
+    pp = page_lookup(curenv->env_pgdir, va, &pte);
+    if (pp && (*pte & (PTE_U | PTE_P | PTE_W)) == (PTE_U | PTE_P | PTE_W)) {
+        // A thread sharing the page table got here first.
+        done = true;
+        goto out;
+    }
+    if (!pp || (*pte & (PTE_U | PTE_P | PTE_COW)) != (PTE_U | PTE_P | PTE_COW))
+        goto out;
+
+    perm = ((*pte & PTE_SYSCALL) | PTE_W) & ~PTE_COW;
+    if (pp->pp_ref == 1) {
+        *pte = PTE_ADDR(*pte) | perm;
+        tlb_invalidate(curenv->env_pgdir, va);
+        done = true;
+    } else if (pp == zero_page && (np = page_alloc(ALLOC_ZERO))) {
+        // Usually straight from the prezeroed pool: nothing to copy.
+        if (page_insert(curenv->env_pgdir, np, va, perm) == 0)
+            done = true;
+        else
+            page_free(np);
+    } else if (pp != zero_page && (np = page_alloc(0))) {
+        memmove(page2kva(np), page2kva(pp), PGSIZE);
+        if (page_insert(curenv->env_pgdir, np, va, perm) == 0)
+            done = true;
+        else
+            page_free(np);
+    }
+out:
+    env_unlock(curenv);
+    return done;
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
@@ -376,6 +435,11 @@ page_fault_handler(struct Trapframe *tf)
 
 	// LAB 4: Your code here.
 
+    if (cow_fault(fault_va, tf->tf_err))
+        return;
+    if (!(tf->tf_err & FEC_PR) && pager_fault(fault_va))
+        return;     // Already paged in; otherwise there's no pager
+
     do {
         if (!curenv->env_pgfault_upcall) {
             cprintf("[%08x] not set env_pgfault_upcall\n", curenv->env_id);
@@ -409,6 +473,7 @@ page_fault_handler(struct Trapframe *tf)
         tf->tf_eip = (uintptr_t) curenv->env_pgfault_upcall;
         tf->tf_esp = (uintptr_t) dststack;
 
+        spin_lock(&sched_lock);
         env_run(curenv);
 
     } while(0);
@@ -6,6 +6,26 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Staging area for FSREQ_READ_PAGES and FSREQ_WRITE_PAGES.
+static char fsipcpages[FSIPC_NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Send the nsend pages at srcva to the file server as a request, and
+// wait for a reply, receiving at most *nrecv pages at dstva (0 if
+// none).  Stores the number of pages received in *nrecv.
+static int
+fsipc_pages(unsigned type, void *srcva, int nsend, void *dstva, int *nrecv)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)srcva);
+
+	ipc_send_pages(fsenv, type, srcva, nsend, PTE_P | PTE_W | PTE_U);
+	return ipc_recv_pages(NULL, dstva, nrecv, NULL);
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,22 +35,15 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
-	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
-
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return fsipc_pages(type, &fsipcbuf, 1, dstva, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
+static ssize_t devfile_write_pages(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
 
@@ -115,15 +128,30 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
-	int r;
+	int npages, r;
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	if (n <= PGSIZE) {
+		if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+			return r;
+		assert(r <= n);
+		assert(r <= PGSIZE);
+		memmove(buf, fsipcbuf.readRet.ret_buf, r);
 		return r;
-	assert(r <= n);
-	assert(r <= PGSIZE);
-	memmove(buf, fsipcbuf.readRet.ret_buf, r);
+	}
+
+	// Large reads come back as up to FSIPC_NPAGES whole pages, which
+	// are often the server's cache pages: copy out and let them go.
+	npages = FSIPC_NPAGES;
+	r = fsipc_pages(FSREQ_READ_PAGES, &fsipcbuf, 1, fsipcpages, &npages);
+	if (r > 0) {
+		assert(r <= n);
+		assert(r <= npages * PGSIZE);
+		memmove(buf, fsipcpages, r);
+	}
+	while (npages-- > 0)
+		sys_page_unmap(0, fsipcpages + npages * PGSIZE);
 	return r;
 }
 
@@ -145,7 +173,9 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
     int r;
     fsipcbuf.write.req_fileid = fd->fd_file.id;
     size_t maxByte = sizeof(fsipcbuf.write.req_buf);
-    fsipcbuf.write.req_n = MIN(maxByte, n);
+    if (n > maxByte)
+        return devfile_write_pages(fd, buf, n);
+    fsipcbuf.write.req_n = n;
     memmove(fsipcbuf.write.req_buf, buf, n);
     
     if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
@@ -157,6 +187,35 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
     return r;
 }
 
+// Write at most FSIPC_NPAGES pages' worth of 'buf' in one request.
+static ssize_t
+devfile_write_pages(struct Fd *fd, const void *buf, size_t n)
+{
+    struct Fsreq_write_pages *req = (struct Fsreq_write_pages *) fsipcpages;
+    size_t m = MIN(n, sizeof(req->req_buf));
+    int npages, i, r;
+    char *pg;
+
+    npages = ROUNDUP(offsetof(struct Fsreq_write_pages, req_buf) + m, PGSIZE) / PGSIZE;
+    // The staging pages may still hold a read reply, or nothing at all.
+    for (i = 0; i < npages; i++) {
+        pg = fsipcpages + i * PGSIZE;
+        if (!(uvpd[PDX(pg)] & PTE_P) || (uvpt[PGNUM(pg)] & (PTE_P|PTE_W)) != (PTE_P|PTE_W))
+            if ((r = sys_page_alloc(0, pg, PTE_P|PTE_U|PTE_W)) < 0)
+                return r;
+    }
+
+    req->req_fileid = fd->fd_file.id;
+    req->req_n = m;
+    memmove(req->req_buf, buf, m);
+
+    if ((r = fsipc_pages(FSREQ_WRITE_PAGES, req, npages, NULL, NULL)) < 0)
+        return r;
+
+    assert(r <= m);
+    return r;
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
@@ -181,6 +240,57 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// Map [offset, offset + len) of the file open on fdnum at va, read-only,
+// without copying: the pages are the file server's own cached blocks,
+// so later writes to the file may show through.  va and offset must be
+// page-aligned.  Nothing is mapped past the end of the file, and the
+// rest of the last page reads as zeros.
+//
+// Returns the number of bytes of the file mapped (0 at end of file),
+// or < 0 on error; -E_INVAL if fdnum is not a file.
+ssize_t
+fmap(int fdnum, void *va, size_t len, off_t offset)
+{
+	struct Fd *fd;
+	size_t i;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id || PGOFF(va) || PGOFF(offset))
+		return -E_INVAL;
+
+	for (i = 0; i < len; i += PGSIZE) {
+		fsipcbuf.map.req_fileid = fd->fd_file.id;
+		fsipcbuf.map.req_offset = offset + i;
+		if ((r = fsipc(FSREQ_MAP, (char *) va + i)) < 0)
+			return r;
+		if (r < PGSIZE)
+			return MIN(i + r, len);
+	}
+	return len;
+}
+
+// Unmap what fmap mapped at [va, va + len).
+void
+funmap(void *va, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += PGSIZE)
+		sys_page_unmap(0, (char *) va + i);
+}
+
+// Delete a file, which must not be open
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
@@ -191,3 +301,21 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Fetch the file server's block cache statistics into *st, first
+// changing the cache settings to those in *set that are nonzero if set
+// is not null.
+int
+fscache(const struct Fsreq_cache *set, struct Fsret_cache *st)
+{
+	int r;
+
+	memset(&fsipcbuf.cache, 0, sizeof(fsipcbuf.cache));
+	if (set)
+		fsipcbuf.cache = *set;
+	if ((r = fsipc(FSREQ_CACHE, NULL)) < 0)
+		return r;
+	if (st)
+		*st = fsipcbuf.cacheRet;
+	return 0;
+}
+
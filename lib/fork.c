@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -75,11 +71,14 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued on batch b; they take effect when it is
+// flushed, in the order they were queued.
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
 static int
-duppage(envid_t envid, unsigned pn)
+duppage(struct PageMapBatch *b, envid_t envid, unsigned pn)
 {
 	// LAB 4: Your code here.
 	int r;
@@ -93,20 +92,19 @@ duppage(envid_t envid, unsigned pn)
 
     // read-only or shared pages
     if (!(pte & (PTE_W | PTE_COW)) || (pte & PTE_SHARE)) {
-        if ((r = sys_page_map(0, addr, envid, addr, pte & PTE_SYSCALL)) < 0) {
+        if ((r = pagemap_add(b, 0, addr, envid, addr, pte & PTE_SYSCALL)) < 0) {
             panic("duppage: read-only pages %e", r); 
         }    
 
         return r;
     }
     
-    r = sys_page_map(0, addr, envid, addr, ((pte & PTE_SYSCALL) | PTE_COW) & (~PTE_W));
+    r = pagemap_add(b, 0, addr, envid, addr, ((pte & PTE_SYSCALL) | PTE_COW) & (~PTE_W));
     if (r < 0) {
-        cprintf("pgoff %d\n", ((pte & PTE_SYSCALL) | PTE_COW) & (~PTE_W));
         panic("duppage: sys_page_map, env_id = %d, %d %e", envid, r, r);
     }
 
-    r = sys_page_map(0, addr, 0, addr, (pte | PTE_COW) & (~PTE_W));
+    r = pagemap_add(b, 0, addr, 0, addr, ((pte & PTE_SYSCALL) | PTE_COW) & (~PTE_W));
     if (r < 0) {
         panic("duppage: sys_page_map(0, addr, 0, addr, PGOFF(pte));");
     }
@@ -115,6 +113,26 @@ duppage(envid_t envid, unsigned pn)
 	return 0;
 }
 
+//
+// Fork with copy-on-write, done by the kernel in a single system call.
+// Copy-on-write faults in parent and child are resolved by the kernel
+// too.  Falls back to the user-level ufork if the kernel has no
+// SYS_fork, or ran out of memory copying the page tables in one go.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t env_id = sys_fork();
+
+	if (env_id == -E_NO_SYS || env_id == -E_NO_MEM)
+		env_id = ufork();
+	if (env_id < 0)
+		panic("fork error: %e", env_id);
+	return env_id;
+}
+
 //
 // User-level fork with copy-on-write.
 // Set up our page fault handler appropriately.
@@ -132,9 +150,21 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
+    int i, j;
+    int pn;
+    int r;
+    struct PageMapBatch batch;
+
+    // 4MB pages can't be copy-on-write, and there's no 4MB scratch
+    // region to copy them through, so only read-only and PTE_SHARE ones
+    // can be passed on.
+    for (i=0; i<PDX(UTOP); i++)
+        if ((uvpd[i] & (PTE_P | PTE_PS | PTE_W | PTE_SHARE)) == (PTE_P | PTE_PS | PTE_W))
+            return -E_NOT_SUPP;
+
     set_pgfault_handler(pgfault);
     
     int env_id = sys_exofork();
@@ -143,19 +173,21 @@ fork(void)
         panic("fork error: %e", env_id);
     }
 
-    if (env_id == 0) {
-		thisenv = &envs[ENVX(sys_getenvid())];
+    if (env_id == 0)
 		return 0;
-    }
-
-    int i, j;
-    int pn;
-    int r;
 
+    pagemap_init(&batch);
     for (i=0; i<PDX(UTOP); i++) {
         if (!(uvpd[i] & PTE_P))
             continue;
 
+        // Read-only and PTE_SHARE 4MB pages are shared as they are.
+        if (uvpd[i] & PTE_PS) {
+            if ((r = pagemap_add(&batch, 0, PGADDR(i, 0, 0), env_id, PGADDR(i, 0, 0), uvpd[i] & PTE_SYSCALL)) < 0)
+                panic("fork: sys_page_map large page: %e", r);
+            continue;
+        }
+
         for (j=0; j<NPTENTRIES; j++) {
             pn = i * NPTENTRIES + j;
             if (!(uvpt[pn] & PTE_P))
@@ -164,11 +196,13 @@ fork(void)
             if (pn == PGNUM(UXSTACKTOP - PGSIZE))
                 continue;
 
-            if ((r = duppage(env_id, pn)) < 0) {
+            if ((r = duppage(&batch, env_id, pn)) < 0) {
                 panic("fork: duppage");
             }
         }
     }
+    if ((r = pagemap_flush(&batch)) < 0)
+        panic("fork: sys_page_map_batch: %e", r);
 
     if ((r = sys_env_set_pgfault_upcall(env_id, thisenv->env_pgfault_upcall)) < 0) {
         panic("sys_env_set_pgfault_upcall error: %e", r);
@@ -186,10 +220,19 @@ fork(void)
 	// panic("fork not implemented");
 }
 
-// Challenge!
-int
+//
+// Shared-memory fork: the child is a thread that shares our address
+// space, except that the stacks are copy-on-write as in fork, so each
+// side keeps its own.  thisenv is per-thread (see inc/lib.h).
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	envid_t env_id = sys_sfork();
+
+	if (env_id < 0)
+		panic("sfork error: %e", env_id);
+	return env_id;
 }
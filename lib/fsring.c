@@ -0,0 +1,139 @@
+// Client side of the file server's request rings (see struct Fsring
+// in inc/fs.h).  Queue requests with fsring_prep, hand them over with
+// fsring_submit, and collect the answers with fsring_wait; each slot
+// stays busy until its completion is passed to fsring_seen.
+
+#include <inc/fs.h>
+#include <inc/string.h>
+#include <inc/lib.h>
+
+// Where our ring lives.  It is PTE_SHARE so that fork leaves it alone
+// in the parent; a child sets up one of its own over the top.
+#define FSRINGVA	0xCFFE0000
+
+static struct Fsring *ring = (struct Fsring *) FSRINGVA;
+static envid_t ring_owner;	// env that set up the ring, 0 if none
+static envid_t fsenv;
+static uint32_t slots_busy;	// bitmap of slots in use
+static uint32_t sq_queued;	// prepared but not yet submitted
+static uint32_t inflight;	// submitted but not yet waited for
+
+static union Fsipc *
+slot_page(uint32_t slot)
+{
+	return (union Fsipc *) (FSRINGVA + (slot + 1) * PGSIZE);
+}
+
+// Set up a request ring with the file server, unless we have one.
+int
+fsring_init(void)
+{
+	int i, r;
+
+	if (ring_owner == thisenv->env_id)
+		return 0;
+
+	for (i = 0; i < FSIPC_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (char *) FSRINGVA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			return r;
+	slots_busy = sq_queued = inflight = 0;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	ipc_send_pages(fsenv, FSREQ_RING_SETUP, ring, FSIPC_NPAGES,
+		       PTE_P|PTE_U|PTE_W);
+	if ((r = ipc_recv(NULL, NULL, NULL)) < 0)
+		return r;
+	ring_owner = thisenv->env_id;
+	return 0;
+}
+
+// Claim a slot for a request of the given type on file descriptor
+// fdnum (ignored for FSREQ_SYNC), fill in the file id and return the
+// request page in *req for the caller to complete.  'data' comes back
+// in the completion.  The request goes out at the next fsring_submit.
+//
+// Returns the slot number, -E_NO_MEM if every slot is busy, or < 0 on
+// other errors.
+int
+fsring_prep(unsigned type, int fdnum, uint32_t data, union Fsipc **req)
+{
+	struct Fsring_sqe *sqe;
+	struct Fd *fd;
+	uint32_t slot;
+	int r;
+
+	if ((r = fsring_init()) < 0)
+		return r;
+	for (slot = 0; slot < FSRING_NSLOTS; slot++)
+		if (!(slots_busy & (1 << slot)))
+			break;
+	if (slot == FSRING_NSLOTS)
+		return -E_NO_MEM;
+
+	*req = slot_page(slot);
+	if (type != FSREQ_SYNC) {
+		if ((r = fd_lookup(fdnum, &fd)) < 0)
+			return r;
+		if (fd->fd_dev_id != devfile.dev_id)
+			return -E_INVAL;
+		// Every request that can be queued starts with the file id
+		(*req)->read.req_fileid = fd->fd_file.id;
+	}
+
+	sqe = &ring->r_sq[(ring->r_sq_tail + sq_queued) % FSRING_NENT];
+	sqe->sqe_type = type;
+	sqe->sqe_slot = slot;
+	sqe->sqe_data = data;
+	slots_busy |= 1 << slot;
+	sq_queued++;
+	return slot;
+}
+
+// Hand every prepared request to the file server, waking it if it is
+// asleep.  Returns the number of requests submitted.
+int
+fsring_submit(void)
+{
+	int n = sq_queued;
+
+	if (n == 0)
+		return 0;
+	__sync_synchronize();
+	ring->r_sq_tail += n;
+	inflight += n;
+	sq_queued = 0;
+	__sync_synchronize();
+	if (ring->r_flags & FSRING_NEED_WAKEUP)
+		ipc_send(fsenv, FSREQ_RING_KICK, NULL, 0);
+	return n;
+}
+
+// Wait for the next completion and copy it to *cqe.  If reply is not
+// null, *reply is set to the request's page, where any data the server
+// sent back is.  Returns -E_INVAL if no requests are outstanding.
+int
+fsring_wait(struct Fsring_cqe *cqe, union Fsipc **reply)
+{
+	uint32_t head;
+
+	if (ring_owner != thisenv->env_id || inflight == 0)
+		return -E_INVAL;
+	while ((head = ring->r_cq_head) == ring->r_cq_tail)
+		sys_yield();
+	__sync_synchronize();
+	*cqe = ring->r_cq[head % FSRING_NENT];
+	ring->r_cq_head = head + 1;
+	inflight--;
+	if (reply)
+		*reply = slot_page(cqe->cqe_slot % FSRING_NSLOTS);
+	return 0;
+}
+
+// Done with the reply for cqe: its slot may be reused.
+void
+fsring_seen(struct Fsring_cqe *cqe)
+{
+	slots_busy &= ~(1 << cqe->cqe_slot);
+}
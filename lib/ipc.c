@@ -23,13 +23,22 @@ int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
 	// LAB 4: Your code here.
+    return ipc_recv_pages(from_env_store, pg, NULL, perm_store);
+}
+
+// Like ipc_recv, but take up to *npages pages at pg (1 if npages is
+// null), and store the number actually received in *npages.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, int *npages, int *perm_store)
+{
     if (pg == NULL) {
         pg = (void *)UTOP;
     }
 
-    int r = sys_ipc_recv(pg);
+    int r = sys_ipc_recv_pages(pg, npages ? *npages : 1);
     if (from_env_store) *from_env_store = (r == 0)? thisenv->env_ipc_from: 0;
     if (perm_store) *perm_store = (r == 0)? thisenv->env_ipc_perm: 0;
+    if (npages) *npages = (r == 0)? thisenv->env_ipc_npages: 0;
 
     if (r) return r;
 
@@ -48,12 +57,19 @@ void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 4: Your code here.
+    ipc_send_pages(to_env, val, pg, 1, perm);
+}
+
+// Like ipc_send, but send the npages pages starting at pg.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, int npages, int perm)
+{
     if (pg == NULL) {
         pg = (void *)UTOP;
     }
 
     int r;
-    while ((r = sys_ipc_try_send(to_env, val, pg, perm)) < 0) {
+    while ((r = sys_ipc_try_send_pages(to_env, val, pg, npages, perm)) < 0) {
         if (r != -E_IPC_NOT_RECV)
             panic("ipc_send: sys_ipc_send, %d, %e", r, r);
         
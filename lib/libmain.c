@@ -5,17 +5,13 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
 libmain(int argc, char **argv)
 {
-	// set thisenv to point at our Env structure in envs[].
-	// LAB 3: Your code here.
-	envid_t id = sys_getenvid();
-    thisenv = (struct Env *)envs + ENVX(id);
-    //cprintf("userprog start! thisenv = %08x\n", thisenv);
+	// thisenv needs no setting up: the kernel points %gs at our
+	// Env structure in envs[] (see inc/lib.h).
 
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
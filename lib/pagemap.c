@@ -0,0 +1,50 @@
+// Queue up sys_page_map calls and issue them with sys_page_map_batch,
+// up to PAGEMAP_BATCH at a time.
+
+#include <inc/lib.h>
+
+void
+pagemap_init(struct PageMapBatch *b)
+{
+	b->pb_n = 0;
+}
+
+// Queue a sys_page_map(srcenv, srcva, dstenv, dstva, perm).  Queued
+// operations are applied in order.  Returns 0, or the error from
+// flushing a full batch.
+int
+pagemap_add(struct PageMapBatch *b, envid_t srcenv, void *srcva,
+	    envid_t dstenv, void *dstva, int perm)
+{
+	struct PageMapOp *op;
+
+	if (b->pb_n == PAGEMAP_BATCH) {
+		int r = pagemap_flush(b);
+		if (r < 0)
+			return r;
+	}
+	op = &b->pb_ops[b->pb_n++];
+	op->pm_srcenv = srcenv;
+	op->pm_srcva = srcva;
+	op->pm_dstenv = dstenv;
+	op->pm_dstva = dstva;
+	op->pm_perm = perm;
+	return 0;
+}
+
+// Queue a sys_page_unmap(env, va).
+int
+pagemap_unmap(struct PageMapBatch *b, envid_t env, void *va)
+{
+	return pagemap_add(b, 0, 0, env, va, 0);
+}
+
+// Apply all queued operations.  Returns 0 or the first error.
+int
+pagemap_flush(struct PageMapBatch *b)
+{
+	int n = b->pb_n;
+
+	b->pb_n = 0;
+	return n ? sys_page_map_batch(b->pb_ops, n) : 0;
+}
@@ -5,11 +5,21 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Where a lazily loaded child keeps a reference to its program file,
+// so that the file server can page it in for as long as it runs.
+// Outside the fd table, so that close_all leaves it alone.
+#define PAGERFD			(0xD0000000 - PGSIZE)
+
+// Leave program pages to be faulted in from the file server on first
+// touch, instead of reading them all before the child starts.
+bool spawn_lazy = 1;
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
+static int set_pager(envid_t child, int fd, uintptr_t start, uintptr_t end);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -27,6 +37,7 @@ spawn(const char *prog, const char **argv)
 	struct Elf *elf;
 	struct Proghdr *ph;
 	int perm;
+	uintptr_t start = UTOP, end = 0;
 
 	// This code follows this procedure:
 	//
@@ -119,16 +130,22 @@ spawn(const char *prog, const char **argv)
 		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
 			perm |= PTE_W;
 		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+				     spawn_lazy ? -1 : fd, ph->p_filesz,
+				     ph->p_offset, perm)) < 0)
 			goto error;
+		start = MIN(start, ROUNDDOWN(ph->p_va, PGSIZE));
+		end = MAX(end, ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE));
 	}
-	close(fd);
-	fd = -1;
 
 	// Copy shared library state.
 	if ((r = copy_shared_pages(child)) < 0)
 		panic("copy_shared_pages: %e", r);
 
+	if ((r = set_pager(child, fd, start, end)) < 0)
+		goto error;
+	close(fd);
+	fd = -1;
+
 	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
 		panic("sys_env_set_trapframe: %e", r);
 
@@ -259,6 +276,8 @@ error:
 	return r;
 }
 
+// Map the segment into the child.  With fd < 0, pages holding file
+// data are left unmapped for the pager; only blank pages are mapped.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
@@ -277,10 +296,11 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			// map a blank page: the zero page, copied on first write
+			if ((r = sys_page_alloc(child, (void*) (va + i),
+					(perm & PTE_W) ? (perm & ~PTE_W) | PTE_COW : perm)) < 0)
 				return r;
-		} else {
+		} else if (fd >= 0) {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
 				return r;
@@ -296,6 +316,26 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	return 0;
 }
 
+// Make the file server the child's pager for its program, mapped at
+// [start, end) from the file open on fdnum, or give it no pager at all
+// if it was loaded eagerly.
+static int
+set_pager(envid_t child, int fdnum, uintptr_t start, uintptr_t end)
+{
+	struct Fd *fd;
+	int r;
+
+	if (!spawn_lazy)
+		return sys_env_set_pager(child, 0, 0, 0, 0);
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if ((r = sys_page_map(0, fd, child, (void *) PAGERFD,
+			      PTE_P|PTE_U|PTE_SHARE)) < 0)
+		return r;
+	return sys_env_set_pager(child, ipc_find_env(ENV_TYPE_FS),
+				 start, end, fd->fd_file.id);
+}
+
 // Copy the mappings for shared pages into the child address space.
 static int
 copy_shared_pages(envid_t child)
@@ -304,18 +344,27 @@ copy_shared_pages(envid_t child)
     int i, j;
     int pn;
     int r;
+    struct PageMapBatch batch;
 
+    pagemap_init(&batch);
     for (i=0; i<PDX(UTOP); i++) {
         if (!(uvpd[i] & PTE_P))
             continue;
 
+        if (uvpd[i] & PTE_PS) {
+            if ((uvpd[i] & PTE_SHARE)
+                && (r = pagemap_add(&batch, 0, PGADDR(i, 0, 0), child, PGADDR(i, 0, 0), uvpd[i] & PTE_SYSCALL)) < 0)
+                return r;
+            continue;
+        }
+
         for (j=0; j<NPTENTRIES; j++) {
             pn = i * NPTENTRIES + j;
             if (!(uvpt[pn] & PTE_P))
                 continue;
 
-            if (uvpt[pn] & PTE_SHARE) {
-                if ((r = sys_page_map(0, (void *)(pn * PGSIZE), child, (void *)(pn * PGSIZE), uvpt[pn] & PTE_SYSCALL)) < 0) {
+            if ((uvpt[pn] & PTE_SHARE) && pn != PGNUM(PAGERFD)) {
+                if ((r = pagemap_add(&batch, 0, (void *)(pn * PGSIZE), child, (void *)(pn * PGSIZE), uvpt[pn] & PTE_SYSCALL)) < 0) {
                     cprintf("in copy_shared_pages, sys_page_map: %e", r);
                     return r;
                 }
@@ -324,6 +373,10 @@ copy_shared_pages(envid_t child)
         }
     }
 
+    if ((r = pagemap_flush(&batch)) < 0) {
+        cprintf("in copy_shared_pages, sys_page_map: %e", r);
+        return r;
+    }
 	return 0;
 }
 
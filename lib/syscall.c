@@ -85,14 +85,38 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_map_batch(const struct PageMapOp *ops, int n)
+{
+	return syscall(SYS_page_map_batch, 1, (uint32_t) ops, n, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_sfork(void)
+{
+	return syscall(SYS_sfork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -105,24 +129,49 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_pager(envid_t envid, envid_t pager, uintptr_t start,
+		  uintptr_t end, uint32_t arg)
+{
+	return syscall(SYS_env_set_pager, 1, envid, pager, start, end, arg);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, int npages, int perm)
+{
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, npages);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_pages(void *dstva, int npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_sleep(unsigned int msec)
+{
+	return syscall(SYS_sleep, 0, msec, 0, 0, 0, 0);
+}
+
 int sys_net_try_send(void *data, size_t len) 
 {
     return syscall(SYS_net_try_send, 1, (uint32_t) data, len, 0, 0, 0);
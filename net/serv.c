@@ -347,6 +347,12 @@ umain(int argc, char **argv)
 		return;
 	}
 
+	// Children start at normal priority; the helpers are part of the
+	// network server.
+	sys_env_set_priority(timer_envid, ENV_PRIO_SERVER);
+	sys_env_set_priority(input_envid, ENV_PRIO_SERVER);
+	sys_env_set_priority(output_envid, ENV_PRIO_SERVER);
+
 	// lwIP requires a user threading library; start the library and jump
 	// into a thread to continue initialization.
 	thread_init();
@@ -0,0 +1,53 @@
+// Fill the disk with files, a block at a time, and report the cost per
+// block allocated as the disk fills up.  With a cursor-based bitmap
+// search the cost should not climb as free blocks get scarce.  Build
+// the file system image with more blocks (fs/Makefrag) for a longer run.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define STEP	128	// blocks per line of output
+#define MAXFILES 64
+
+static char buf[BLKSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXNAMELEN];
+	uint64_t start;
+	int fd, nfiles, nblocks, n, r;
+
+	nblocks = 0;
+	start = read_tsc();
+	for (nfiles = 0; nfiles < MAXFILES; nfiles++) {
+		snprintf(path, sizeof(path), "/fill%d", nfiles);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", path, fd);
+		// A file is full at MAXFILESIZE, the disk when write fails
+		for (n = 0; n < MAXFILESIZE; n += BLKSIZE) {
+			if ((r = write(fd, buf, BLKSIZE)) < 0)
+				break;
+			if (++nblocks % STEP == 0) {
+				cprintf("allocbench: blocks %5d-%5d: %llu cycles/block\n",
+					nblocks - STEP, nblocks,
+					(read_tsc() - start) / STEP);
+				start = read_tsc();
+			}
+		}
+		close(fd);
+		if (n < MAXFILESIZE) {
+			nfiles++;
+			break;
+		}
+	}
+	cprintf("allocbench: %d blocks allocated in %d files\n",
+		nblocks, nfiles);
+
+	// Give the space back
+	while (--nfiles >= 0) {
+		snprintf(path, sizeof(path), "/fill%d", nfiles);
+		if ((fd = open(path, O_WRONLY|O_TRUNC)) >= 0)
+			close(fd);
+	}
+}
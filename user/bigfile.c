@@ -0,0 +1,63 @@
+// Write a file too big for the direct and indirect blocks alone, read
+// it back and check it.  Blocks written in order should land next to
+// each other on disk, so reading it back should take far fewer disk
+// transfers than blocks.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FILE	"/bigfile.dat"
+#define FSIZE	(12 * 1024 * 1024)
+#define CHUNK	(FSIPC_NPAGES * PGSIZE)
+
+static uint32_t buf[CHUNK / 4];
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsreq_cache set = { .req_limit = 256 };
+	struct Fsret_cache before, after, st;
+	uint64_t start, twrite, tread;
+	int fd, i, n, off, r;
+
+	if ((r = fscache(NULL, &st)) < 0)
+		panic("fscache: %e", r);
+
+	if ((fd = open(FILE, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILE, fd);
+	start = read_tsc();
+	for (off = 0; off < FSIZE; off += n) {
+		for (i = 0; i < CHUNK / 4; i++)
+			buf[i] = off / 4 + i;
+		if ((n = write(fd, buf, CHUNK)) <= 0)
+			panic("write %s at %d: %e", FILE, off, n);
+	}
+	close(fd);
+	twrite = read_tsc() - start;
+
+	// Shrink the cache to push the file out, so it is read from disk
+	fscache(&set, NULL);
+	set.req_limit = st.ret_limit;
+	fscache(&set, &before);
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %e", FILE, fd);
+	start = read_tsc();
+	for (off = 0; (n = readn(fd, buf, CHUNK)) > 0; off += n)
+		for (i = 0; i < n / 4; i++)
+			if (buf[i] != off / 4 + i)
+				panic("%s: bad data at %d", FILE, off + i * 4);
+	tread = read_tsc() - start;
+	if (n < 0 || off != FSIZE)
+		panic("read %s: %e, %d bytes", FILE, n, off);
+	close(fd);
+	fscache(NULL, &after);
+
+	cprintf("bigfile: %d KB: write %llu cycles, read %llu cycles, "
+		"%u blocks read in %u disk reads\n", FSIZE / 1024, twrite, tread,
+		after.ret_misses - before.ret_misses,
+		after.ret_reads - before.ret_reads);
+
+	if ((fd = open(FILE, O_WRONLY|O_TRUNC)) >= 0)
+		close(fd);
+}
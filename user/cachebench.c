@@ -0,0 +1,75 @@
+// Read a 1MB file twice under a small and a large file server block
+// cache limit, printing the cache counters after each.  Under the small
+// limit the second pass has to read the file from disk again, with
+// blocks being evicted, and the cache stays within its limit.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FILE	"/cachebench.dat"
+#define FSIZE	(1024 * 1024)
+
+static char buf[8192];
+
+static void
+make_file(void)
+{
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILE, fd);
+	for (i = 0; i < FSIZE; i += sizeof(buf))
+		if ((r = write(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("write %s: %e", FILE, r);
+	close(fd);
+}
+
+static void
+run(uint32_t limit)
+{
+	struct Fsreq_cache set = { .req_limit = limit };
+	struct Fsret_cache before, after;
+	uint64_t start;
+	int fd, pass, n, r;
+
+	if ((r = fscache(&set, &before)) < 0)
+		panic("fscache: %e", r);
+	start = read_tsc();
+	for (pass = 0; pass < 2; pass++) {
+		if ((fd = open(FILE, O_RDONLY)) < 0)
+			panic("open %s: %e", FILE, fd);
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			;
+		close(fd);
+	}
+	if ((r = fscache(NULL, &after)) < 0)
+		panic("fscache: %e", r);
+
+	cprintf("cachebench: limit %4u blocks: %llu cycles, %u hits, "
+		"%u misses, %u evictions, %u writebacks, %u resident\n",
+		after.ret_limit, read_tsc() - start,
+		after.ret_hits - before.ret_hits,
+		after.ret_misses - before.ret_misses,
+		after.ret_evictions - before.ret_evictions,
+		after.ret_writebacks - before.ret_writebacks,
+		after.ret_resident);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cache st;
+	struct Fsreq_cache set;
+	int fd, r;
+
+	if ((r = fscache(NULL, &st)) < 0)
+		panic("fscache: %e", r);
+	make_file();
+	run(64);
+	run(1024);
+	set.req_limit = st.ret_limit;
+	set.req_dirty_age = set.req_dirty_ratio = 0;
+	fscache(&set, NULL);
+	if ((fd = open(FILE, O_WRONLY|O_TRUNC)) >= 0)
+		close(fd);
+}
@@ -0,0 +1,63 @@
+// Grow a directory to thousands of entries, timing file creation and
+// name lookup (stat) along the way, then remove the files again.  With
+// the directory index both should cost about the same at every size.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NFILES	4096
+#define NLOOKUP	256
+
+static void
+name(char *buf, int i)
+{
+	snprintf(buf, MAXNAMELEN, "/dirbench.%d", i);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXNAMELEN];
+	struct Stat st;
+	uint64_t start, tcreate;
+	int n, prev, next, i, fd, r;
+
+	start = read_tsc();
+	for (n = prev = 0, next = 256; n < NFILES; ) {
+		name(path, n);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL)) < 0)
+			panic("create %s: %e", path, fd);
+		close(fd);
+		if (++n < next)
+			continue;
+		tcreate = read_tsc() - start;
+
+		start = read_tsc();
+		for (i = 0; i < NLOOKUP; i++) {
+			name(path, (i * 7919) % n);
+			if ((r = stat(path, &st)) < 0)
+				panic("stat %s: %e", path, r);
+		}
+		cprintf("dirbench: %4d entries: %llu cycles/create, "
+			"%llu cycles/lookup\n", n, tcreate / (n - prev),
+			(read_tsc() - start) / NLOOKUP);
+		prev = n;
+		next *= 2;
+		start = read_tsc();
+	}
+
+	name(path, NFILES);
+	if ((r = stat(path, &st)) != -E_NOT_FOUND)
+		panic("stat %s: got %e, want not found", path, r);
+
+	start = read_tsc();
+	for (i = 0; i < NFILES; i++) {
+		name(path, i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	cprintf("dirbench: %llu cycles/remove\n", (read_tsc() - start) / NFILES);
+	name(path, 0);
+	if ((r = stat(path, &st)) != -E_NOT_FOUND)
+		panic("stat %s after remove: got %e", path, r);
+}
@@ -54,11 +54,8 @@ dumbfork(void)
 	if (envid < 0)
 		panic("sys_exofork: %e", envid);
 	if (envid == 0) {
-		// We're the child.
-		// The copied value of the global variable 'thisenv'
-		// is no longer valid (it refers to the parent!).
-		// Fix it and return 0.
-		thisenv = &envs[ENVX(sys_getenvid())];
+		// We're the child.  thisenv follows us by itself
+		// (see inc/lib.h), so just return 0.
 		return 0;
 	}
 
@@ -0,0 +1,92 @@
+// Measure what sharing program text out of the file server's block
+// cache buys.  Run from the shell, so that this program was itself
+// paged in by the file server: it then starts NINST more copies of
+// itself, which all touch their text and wait, and counts the text
+// pages they share.  It then times a shell script of NCMD commands.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NINST	8
+#define NCMD	100
+#define SCRIPT	"/execbench.sh"
+
+extern char etext[];
+
+static void
+touch_text(void)
+{
+	volatile char *p;
+	for (p = (char *) UTEXT; p < etext; p += PGSIZE)
+		(void) *p;
+}
+
+static void
+measure_sharing(void)
+{
+	envid_t inst[NINST];
+	int i, shared = 0, text = 0;
+	char *va;
+
+	if (!thisenv->env_pager) {
+		cprintf("execbench: not demand paged; run me from sh\n");
+		return;
+	}
+
+	touch_text();
+	for (i = 0; i < NINST; i++)
+		if ((inst[i] = spawnl("/execbench", "execbench", "wait", 0)) < 0)
+			panic("spawn: %e", inst[i]);
+	for (i = 0; i < NINST; i++)
+		while (!envs[ENVX(inst[i])].env_ipc_recving)
+			sys_yield();
+
+	// Shared pages are mapped by the file server, us and every copy.
+	for (va = (char *) UTEXT; va < etext; va += PGSIZE, text++)
+		if (pageref(va) >= NINST + 2)
+			shared++;
+	cprintf("execbench: %d instances share %d of %d text pages, "
+		"saving %d KB\n", NINST, shared, text,
+		shared * NINST * PGSIZE / 1024);
+
+	for (i = 0; i < NINST; i++) {
+		sys_env_destroy(inst[i]);
+		wait(inst[i]);
+	}
+}
+
+static void
+time_script(void)
+{
+	uint64_t start, end;
+	envid_t sh;
+	int fd, i;
+
+	if ((fd = open(SCRIPT, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", SCRIPT, fd);
+	for (i = 0; i < NCMD; i++)
+		fprintf(fd, "echo %d > /execbench.out\n", i);
+	close(fd);
+
+	start = read_tsc();
+	if ((sh = spawnl("/sh", "sh", SCRIPT, 0)) < 0)
+		panic("spawn sh: %e", sh);
+	wait(sh);
+	end = read_tsc();
+	cprintf("execbench: %d commands, %llu cycles per command\n",
+		NCMD, (end - start) / NCMD);
+}
+
+void
+umain(int argc, char **argv)
+{
+	if (argc > 1) {
+		// One of the copies: map in all our text, then wait.
+		touch_text();
+		ipc_recv(0, 0, 0);
+		return;
+	}
+
+	measure_sharing();
+	time_script();
+}
@@ -0,0 +1,96 @@
+// Compare the kernel's fork (sys_fork) with the user-level ufork, and
+// the cost of the first write to a copy-on-write page when the kernel
+// resolves the fault against the user-level upcall doing the same copy.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	256
+#define NFORK	32
+
+static char heap[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static uint64_t
+time_fork(envid_t (*forkfn)(void))
+{
+	uint64_t start, total = 0;
+	envid_t who;
+	int i;
+
+	for (i = 0; i < NFORK; i++) {
+		start = read_tsc();
+		if ((who = forkfn()) < 0)
+			panic("fork: %e", who);
+		if (who == 0)
+			exit();
+		total += read_tsc() - start;
+		wait(who);
+	}
+	return total / NFORK;
+}
+
+static uint64_t
+time_writes(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		heap[i * PGSIZE] = i + 1;
+	return (read_tsc() - start) / NPAGES;
+}
+
+// What ufork's pgfault handler does for a copy-on-write page.
+static void
+copy_handler(struct UTrapframe *utf)
+{
+	void *addr = ROUNDDOWN((void *) utf->utf_fault_va, PGSIZE);
+	int r;
+
+	if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	memmove(PFTEMP, addr, PGSIZE);
+	if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+	if ((r = sys_page_unmap(0, PFTEMP)) < 0)
+		panic("sys_page_unmap: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t kfork, ufork_cycles, kwrite, uwrite;
+	envid_t who;
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		heap[i * PGSIZE] = i;
+
+	kfork = time_fork(fork);
+	ufork_cycles = time_fork(ufork);
+
+	// Kernel path: a live child keeps every heap page shared, so each
+	// first write copies.
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		ipc_recv(0, 0, 0);
+		exit();
+	}
+	kwrite = time_writes();
+	ipc_send(who, 0, 0, 0);
+	wait(who);
+
+	// User path: read-only pages, copied by the upcall.
+	set_pgfault_handler(copy_handler);
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_map(0, &heap[i * PGSIZE], 0, &heap[i * PGSIZE], PTE_P|PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+	uwrite = time_writes();
+
+	cprintf("forkbench: %d pages: fork %llu cycles, ufork %llu cycles\n",
+		NPAGES, kfork, ufork_cycles);
+	cprintf("forkbench: first write: kernel %llu cycles, upcall %llu cycles\n",
+		kwrite, uwrite);
+}
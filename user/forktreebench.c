@@ -0,0 +1,47 @@
+// Time forktree: a binary tree of processes, each waiting for its two
+// children.  Fork cost is dominated by the page mappings it sets up, so
+// give every process a few hundred pages of heap to copy-on-write.
+
+#include <inc/lib.h>
+
+#define DEPTH	4
+#define NPAGES	256
+
+static char heap[NPAGES * PGSIZE];
+
+static void
+forktree(int depth)
+{
+	envid_t kids[2];
+	int i;
+
+	if (depth == DEPTH)
+		return;
+	for (i = 0; i < 2; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			forktree(depth + 1);
+			exit();
+		}
+	}
+	for (i = 0; i < 2; i++)
+		wait(kids[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, end;
+	int i;
+
+	for (i = 0; i < NPAGES; i++)
+		heap[i * PGSIZE] = i;
+
+	start = sys_time_msec();
+	forktree(0);
+	end = sys_time_msec();
+
+	cprintf("forktreebench: %d envs with %d dirty pages each in %u ms\n",
+		(2 << DEPTH) - 1, NPAGES, end - start);
+}
@@ -0,0 +1,48 @@
+// Measure file server round-trip latency with and without CPU-bound
+// hogs competing for the processor.  With the file server scheduled
+// at ENV_PRIO_SERVER the two numbers should stay close.
+
+#include <inc/lib.h>
+
+#define NHOG	8
+#define NOPS	200
+
+static unsigned
+time_stats(void)
+{
+	struct Stat st;
+	unsigned start;
+	int i, r;
+
+	start = sys_time_msec();
+	for (i = 0; i < NOPS; i++)
+		if ((r = stat("/motd", &st)) < 0)
+			panic("stat /motd: %e", r);
+	return sys_time_msec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t hogs[NHOG];
+	unsigned idle, busy;
+	int i;
+
+	idle = time_stats();
+
+	for (i = 0; i < NHOG; i++) {
+		if ((hogs[i] = fork()) < 0)
+			panic("fork: %e", hogs[i]);
+		if (hogs[i] == 0)
+			while (1)
+				/* do nothing */;
+	}
+
+	busy = time_stats();
+
+	for (i = 0; i < NHOG; i++)
+		sys_env_destroy(hogs[i]);
+
+	cprintf("fslatency: %d stats in %u ms idle, %u ms with %d hogs\n",
+		NOPS, idle, busy, NHOG);
+}
@@ -11,6 +11,12 @@
 #define BUFFSIZE 512
 #define MAXPENDING 5	// Max connection requests
 
+// Window at which send_data maps files, and the most it hands the
+// network server at once.
+#define MAPVA	((char *) 0x40000000)
+#define MAPSIZE	(16 * PGSIZE)
+#define SENDSIZE 1024
+
 struct http_request {
 	int sock;
 	char *url;
@@ -80,7 +86,23 @@ send_data(struct http_request *req, int fd)
 	//panic("send_data not implemented");
     
     char buf[512];
-    int n;
+    off_t off;
+    int n, i, m;
+
+    // Send the file straight out of the file server's cache if we can.
+    for (off = 0; (n = fmap(fd, MAPVA, MAPSIZE, off)) > 0; off += n) {
+        for (i = 0; i < n; i += m) {
+            m = MIN(n - i, SENDSIZE);
+            if (write(req->sock, MAPVA + i, m) != m) {
+                cprintf("send_data: write\n");
+                funmap(MAPVA, n);
+                return -1;
+            }
+        }
+        funmap(MAPVA, n);
+    }
+    if (n != -E_INVAL)
+        return n;
 
     while ((n = readn(fd, buf, 512)) > 0) {
         if (write(req->sock, buf, n) != n) {
@@ -0,0 +1,38 @@
+// Open and close the same files over and over, as httpd does with the
+// pages it serves, and a name that doesn't exist.  After the first
+// round every path component should come from the file server's name
+// cache.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NOPS	1000
+
+static const char *paths[] = { "/motd", "/index.html", "/newmotd" };
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cache before, after;
+	uint64_t start;
+	int i, j, fd, r;
+
+	if ((r = fscache(NULL, &before)) < 0)
+		panic("fscache: %e", r);
+	start = read_tsc();
+	for (i = 0; i < NOPS; i++)
+		for (j = 0; j < sizeof(paths) / sizeof(paths[0]); j++)
+			if ((fd = open(paths[j], O_RDONLY)) >= 0)
+				close(fd);
+			else if (fd != -E_NOT_FOUND)
+				panic("open %s: %e", paths[j], fd);
+	for (i = 0; i < NOPS; i++)
+		if ((fd = open("/no-such-file", O_RDONLY)) != -E_NOT_FOUND)
+			panic("open /no-such-file: got %e", fd);
+	fscache(NULL, &after);
+
+	cprintf("openbench: %llu cycles/open, name cache %u hits, %u misses\n",
+		(read_tsc() - start) / (NOPS * (sizeof(paths) / sizeof(paths[0]) + 1)),
+		after.ret_dhits - before.ret_dhits,
+		after.ret_dmisses - before.ret_dmisses);
+}
@@ -0,0 +1,54 @@
+// Stress the physical page allocator from every CPU at once.  Each
+// worker maps and unmaps a batch of fresh pages over and over, so
+// nearly every system call goes through page_alloc or page_free.
+// Run with CPUS=1, 2, 4 and 8 and compare the elapsed times.
+
+#include <inc/lib.h>
+
+#define NWORKER	8
+#define NBATCH	32
+#define NROUND	200
+
+static void
+worker(void)
+{
+	char *va;
+	int i, j, r;
+
+	for (i = 0; i < NROUND; i++) {
+		for (j = 0; j < NBATCH; j++) {
+			va = (char *) UTEMP + j * PGSIZE;
+			if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+		}
+		for (j = 0; j < NBATCH; j++) {
+			va = (char *) UTEMP + j * PGSIZE;
+			if ((r = sys_page_unmap(0, va)) < 0)
+				panic("sys_page_unmap: %e", r);
+		}
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t workers[NWORKER];
+	unsigned start, end;
+	int i;
+
+	start = sys_time_msec();
+	for (i = 0; i < NWORKER; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0) {
+			worker();
+			exit();
+		}
+	}
+	for (i = 0; i < NWORKER; i++)
+		wait(workers[i]);
+	end = sys_time_msec();
+
+	cprintf("pagebench: %d envs, %d page allocs and frees in %u ms\n",
+		NWORKER, NWORKER * NROUND * NBATCH, end - start);
+}
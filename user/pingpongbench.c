@@ -0,0 +1,35 @@
+// Time IPC round trips between two processes, like pingpong but
+// without the printing.  Every round trip is two env switches, so
+// this shows the cost of the TLB flush in env_run's lcr3.  Run with
+// CPUS=1 so that both envs share a CPU.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND	10000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start, end;
+	uint32_t i;
+
+	if ((who = fork()) == 0) {
+		// Echo until told to stop.
+		while ((i = ipc_recv(&who, 0, 0)) != NROUND)
+			ipc_send(who, i, 0, 0);
+		return;
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++) {
+		ipc_send(who, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+	end = read_tsc();
+	ipc_send(who, NROUND, 0, 0);
+
+	cprintf("pingpongbench: %llu cycles per round trip\n",
+		(end - start) / NROUND);
+}
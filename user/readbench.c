@@ -0,0 +1,82 @@
+// Time reading a large file sequentially with read() a page at a time,
+// which costs a round trip to the file server per page; with large
+// read()s, which move up to FSIPC_NPAGES pages per round trip; and with
+// fmap(), which maps the cached blocks instead of copying them.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FILE	"/readbench.dat"
+#define FSIZE	(1024 * 1024)
+#define BIGBUF	(FSIPC_NPAGES * PGSIZE)
+#define MAPVA	((char *) 0x40000000)
+
+static char buf[BIGBUF];
+
+static uint64_t
+make_file(void)
+{
+	uint64_t start;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILE, fd);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+	start = read_tsc();
+	for (i = 0; i < FSIZE; i += r)
+		if ((r = write(fd, buf, MIN(sizeof(buf), FSIZE - i))) <= 0)
+			panic("write %s: %e", FILE, r);
+	close(fd);
+	return read_tsc() - start;
+}
+
+static uint64_t
+time_read(size_t chunk)
+{
+	uint64_t start;
+	volatile char sink;
+	int fd, n, total;
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %e", FILE, fd);
+	start = read_tsc();
+	for (total = 0; (n = read(fd, buf, chunk)) > 0; total += n)
+		sink = buf[n - 1];
+	if (n < 0 || total != FSIZE)
+		panic("read %s: %e, %d bytes", FILE, n, total);
+	close(fd);
+	return read_tsc() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, twrite, tpage, tbig, tmap;
+	volatile char sink;
+	int fd, n, i;
+	off_t off;
+
+	twrite = make_file();
+	tpage = time_read(PGSIZE);
+	tbig = time_read(BIGBUF);
+
+	if ((fd = open(FILE, O_RDONLY)) < 0)
+		panic("open %s: %e", FILE, fd);
+	start = read_tsc();
+	for (off = 0; (n = fmap(fd, MAPVA, PTSIZE, off)) > 0; off += n) {
+		for (i = 0; i < n; i += PGSIZE)
+			sink = MAPVA[i];
+		funmap(MAPVA, n);
+	}
+	tmap = read_tsc() - start;
+	if (n < 0)
+		panic("fmap: %e", n);
+	close(fd);
+
+	cprintf("readbench: %d KB: write %llu cycles\n", FSIZE / 1024, twrite);
+	cprintf("readbench: read %llu cycles by page, %llu by %d KB, "
+		"fmap %llu cycles\n", tpage, tbig, BIGBUF / 1024, tmap);
+	if ((fd = open(FILE, O_WRONLY|O_TRUNC)) >= 0)
+		close(fd);
+}
@@ -0,0 +1,62 @@
+// Time fstat() on one file, which costs an IPC round trip each, against
+// the same requests queued on a file server ring at growing depths.
+// With more requests in flight per wakeup the cost per request should
+// fall well below the round-trip cost.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NOPS	2000
+
+static int depths[] = { 1, 4, FSRING_NSLOTS };
+
+static uint64_t
+time_ring(int fd, int depth)
+{
+	struct Fsring_cqe cqe;
+	union Fsipc *req;
+	uint64_t start;
+	int queued, done, r;
+
+	start = read_tsc();
+	for (queued = done = 0; done < NOPS; done++) {
+		while (queued < NOPS && queued - done < depth) {
+			if ((r = fsring_prep(FSREQ_STAT, fd, queued, &req)) < 0)
+				panic("fsring_prep: %e", r);
+			queued++;
+		}
+		fsring_submit();
+		if ((r = fsring_wait(&cqe, &req)) < 0)
+			panic("fsring_wait: %e", r);
+		if (cqe.cqe_res < 0)
+			panic("ring stat: %e", cqe.cqe_res);
+		fsring_seen(&cqe);
+	}
+	return read_tsc() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Stat st;
+	uint64_t start, t;
+	int fd, i, r;
+
+	if ((fd = open("/motd", O_RDONLY)) < 0)
+		panic("open /motd: %e", fd);
+
+	start = read_tsc();
+	for (i = 0; i < NOPS; i++)
+		if ((r = fstat(fd, &st)) < 0)
+			panic("fstat: %e", r);
+	cprintf("ringbench: ipc: %llu cycles/stat\n", (read_tsc() - start) / NOPS);
+
+	if ((r = fsring_init()) < 0)
+		panic("fsring_init: %e", r);
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		t = time_ring(fd, depths[i]);
+		cprintf("ringbench: ring depth %2d: %llu cycles/stat\n",
+			depths[i], t / NOPS);
+	}
+	close(fd);
+}
@@ -0,0 +1,42 @@
+// Fork a fixed amount of CPU-bound work and time it.  Run with
+// CPUS=1, 2, 4 and 8: with load balancing the elapsed time should
+// drop close to linearly as CPUs are added.
+
+#include <inc/lib.h>
+
+#define NWORKER	16
+#define NITER	2000000
+
+volatile int sink;
+
+void
+umain(int argc, char **argv)
+{
+	envid_t workers[NWORKER];
+	unsigned start, end;
+	int i, j, mask;
+
+	start = sys_time_msec();
+	for (i = 0; i < NWORKER; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0) {
+			for (j = 0; j < NITER; j++) {
+				sink++;
+				if (j % (NITER / 8) == 0)
+					sys_yield();
+			}
+			exit();
+		}
+	}
+
+	mask = 0;
+	for (i = 0; i < NWORKER; i++) {
+		mask |= 1 << envs[ENVX(workers[i])].env_cpunum;
+		wait(workers[i]);
+	}
+	end = sys_time_msec();
+
+	cprintf("schedscale: %d workers in %u ms, ran on CPU mask %x\n",
+		NWORKER, end - start, mask);
+}
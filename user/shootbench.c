@@ -0,0 +1,65 @@
+// Measure unmapping cost in an address space shared by threads running
+// on other CPUs, which must all have their TLBs shot down.  Unmapping
+// page by page costs a round of IPIs per page; a sys_page_map_batch
+// of unmaps costs one round, or a full flush past the threshold.
+// Run with CPUS=8.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NTHREAD	3
+#define NPAGES	256
+#define REGION	((char *) 0x20000000)
+
+static volatile int done;
+static volatile int sink;
+
+static void
+map_region(void)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct PageMapBatch batch;
+	uint64_t start, single, batched;
+	envid_t who;
+	int i, r;
+
+	for (i = 0; i < NTHREAD; i++) {
+		if ((who = sfork()) < 0)
+			panic("sfork: %e", who);
+		if (who == 0) {
+			while (!done)
+				sink++;
+			return;
+		}
+	}
+
+	map_region();
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_unmap(0, REGION + i * PGSIZE)) < 0)
+			panic("sys_page_unmap: %e", r);
+	single = read_tsc() - start;
+
+	map_region();
+	start = read_tsc();
+	pagemap_init(&batch);
+	for (i = 0; i < NPAGES; i++)
+		if ((r = pagemap_unmap(&batch, 0, REGION + i * PGSIZE)) < 0)
+			panic("pagemap_unmap: %e", r);
+	if ((r = pagemap_flush(&batch)) < 0)
+		panic("pagemap_flush: %e", r);
+	batched = read_tsc() - start;
+
+	done = 1;
+	cprintf("shootbench: %d threads, unmap %d pages: %llu cycles/page singly, %llu batched\n",
+		NTHREAD, NPAGES, single / NPAGES, batched / NPAGES);
+}
@@ -0,0 +1,51 @@
+// Measure the time from calling spawn to the child's first instruction,
+// with program pages faulted in from the file server on demand and
+// with the whole program read in up front.  With lazy loading the cost
+// should no longer grow with the size of the binary.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NSPAWN	8
+
+static uint64_t
+time_spawn(const char *prog)
+{
+	const char *argv[] = { prog, 0 };
+	uint64_t start, total = 0;
+	envid_t who;
+	int i;
+
+	for (i = 0; i < NSPAWN; i++) {
+		start = read_tsc();
+		if ((who = spawn(prog, argv)) < 0)
+			panic("spawn %s: %e", prog, who);
+		while (envs[ENVX(who)].env_runs == 0)
+			/* wait for it to start */;
+		total += read_tsc() - start;
+		sys_env_destroy(who);
+		wait(who);
+	}
+	return total / NSPAWN;
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const char *progs[] = { "/sh", "/httpd" };
+	uint64_t lazy, eager;
+	struct Stat st;
+	int i, r;
+
+	for (i = 0; i < sizeof(progs) / sizeof(progs[0]); i++) {
+		if ((r = stat(progs[i], &st)) < 0)
+			panic("stat %s: %e", progs[i], r);
+		spawn_lazy = 1;
+		lazy = time_spawn(progs[i]);
+		spawn_lazy = 0;
+		eager = time_spawn(progs[i]);
+		cprintf("spawnbench: %s (%d KB): %llu cycles lazy, %llu eager\n",
+			progs[i], st.st_size / 1024, lazy, eager);
+	}
+	spawn_lazy = 1;
+}
@@ -0,0 +1,64 @@
+// Measure aggregate system call throughput with many environments
+// hammering the kernel at once.  Run with CPUS=1, 2, 4 and 8: with
+// fine-grained kernel locking, envs on different CPUs no longer
+// serialize on one lock and throughput should grow with the CPU count.
+
+#include <inc/lib.h>
+
+#define NWORKER	8
+#define NITER	2000
+
+static void
+worker(envid_t peer)
+{
+	char *va = (char *) (UTEMP + 16 * PGSIZE);
+	int i, r;
+
+	for (i = 0; i < NITER; i++) {
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("sys_page_unmap: %e", r);
+		if (i % 16 == 0)
+			sys_yield();
+	}
+
+	// Ping-pong with our partner so that IPC gets exercised too.
+	for (i = 0; i < NITER / 16; i++) {
+		if (peer) {
+			ipc_send(peer, i, 0, 0);
+			ipc_recv(0, 0, 0);
+		} else {
+			envid_t from;
+			ipc_recv(&from, 0, 0);
+			ipc_send(from, i, 0, 0);
+		}
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t workers[NWORKER];
+	unsigned start, end;
+	int i;
+
+	start = sys_time_msec();
+	for (i = 0; i < NWORKER; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0) {
+			// Odd workers drive the IPC, each with the even
+			// worker forked just before it.
+			worker(i % 2 ? workers[i - 1] : 0);
+			exit();
+		}
+	}
+	for (i = 0; i < NWORKER; i++)
+		wait(workers[i]);
+	end = sys_time_msec();
+
+	cprintf("syscallbench: %d envs, %d syscalls in %u ms\n",
+		NWORKER, NWORKER * (NITER * 2 + NITER / 16 * 2 + NITER / 16),
+		end - start);
+}
@@ -0,0 +1,50 @@
+// Compare TLB-miss-heavy access to a 16MB region mapped with 4KB pages
+// against the same region mapped with 4MB (PTE_PS) pages.  Each pass
+// touches one word per 4KB page: 4096 TLB entries' worth with small
+// pages, far more than the TLB holds, but only four with large ones.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define REGION	((char *) 0x60000000)
+#define NLARGE	4
+#define NPASS	50
+
+static uint64_t
+touch(void)
+{
+	volatile char *p;
+	uint64_t start;
+	int pass;
+
+	start = read_tsc();
+	for (pass = 0; pass < NPASS; pass++)
+		for (p = REGION; p < REGION + NLARGE * PTSIZE; p += PGSIZE)
+			(void) *p;
+	return (read_tsc() - start) / (NPASS * NLARGE * NPTENTRIES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char *va;
+	uint64_t small, large;
+	int r;
+
+	for (va = REGION; va < REGION + NLARGE * PTSIZE; va += PGSIZE)
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	small = touch();
+	for (va = REGION; va < REGION + NLARGE * PTSIZE; va += PGSIZE)
+		sys_page_unmap(0, va);
+
+	for (va = REGION; va < REGION + NLARGE * PTSIZE; va += PTSIZE)
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+			panic("sys_page_alloc large: %e", r);
+	large = touch();
+	for (va = REGION; va < REGION + NLARGE * PTSIZE; va += PTSIZE)
+		sys_page_unmap(0, va);
+
+	cprintf("tlbbench: %llu cycles/page with 4KB pages, %llu with 4MB pages\n",
+		small, large);
+}
@@ -0,0 +1,49 @@
+// Time writes to an open file, which should only dirty the file
+// server's block cache, then watch the write-back timer clean the
+// cache within about WB_DIRTY_AGE ms, without any sync or close.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FILE	"/wbbench.dat"
+#define FSIZE	(512 * 1024)
+#define WAIT	3000	// ms
+
+static char buf[BLKSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cache before, st;
+	uint64_t start, twrite;
+	unsigned t0;
+	int fd, i, r;
+
+	if ((fd = open(FILE, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", FILE, fd);
+	if ((r = fscache(NULL, &before)) < 0)
+		panic("fscache: %e", r);
+
+	start = read_tsc();
+	for (i = 0; i < FSIZE; i += sizeof(buf))
+		if ((r = write(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("write %s: %e", FILE, r);
+	twrite = read_tsc() - start;
+	cprintf("wbbench: %d KB written in %llu cycles\n", FSIZE / 1024, twrite);
+
+	t0 = sys_time_msec();
+	do {
+		sys_yield();
+		if ((r = fscache(NULL, &st)) < 0)
+			panic("fscache: %e", r);
+	} while ((st.ret_writebacks - before.ret_writebacks < FSIZE / BLKSIZE
+		  || st.ret_dirty > 0) && sys_time_msec() - t0 < WAIT);
+	cprintf("wbbench: %u blocks written back, %u dirty after %u ms "
+		"(dirty age %u ms, ratio %u%%)\n",
+		st.ret_writebacks - before.ret_writebacks, st.ret_dirty,
+		sys_time_msec() - t0, st.ret_dirty_age, st.ret_dirty_ratio);
+
+	close(fd);
+	if ((fd = open(FILE, O_WRONLY|O_TRUNC)) >= 0)
+		close(fd);
+}
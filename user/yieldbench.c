@@ -0,0 +1,47 @@
+// Measure sys_yield latency as the number of blocked environments grows.
+// The scheduler should only look at runnable envs, so the cost of a
+// yield ought to stay flat no matter how many envs sit in ipc_recv.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NYIELD		2000
+#define MAXBLOCKED	512
+
+static envid_t blocked[MAXBLOCKED];
+
+void
+umain(int argc, char **argv)
+{
+	int nblocked = 0, target, i;
+	uint64_t start, end;
+	envid_t who;
+
+	for (target = 0; target <= MAXBLOCKED; target = target ? target * 2 : 8) {
+		// Park more children in ipc_recv until we have 'target' of them.
+		while (nblocked < target) {
+			if ((who = fork()) < 0)
+				panic("fork: %e", who);
+			if (who == 0) {
+				ipc_recv(0, 0, 0);
+				return;
+			}
+			blocked[nblocked++] = who;
+		}
+		for (i = 0; i < nblocked; i++)
+			while (envs[ENVX(blocked[i])].env_status != ENV_NOT_RUNNABLE)
+				sys_yield();
+
+		start = read_tsc();
+		for (i = 0; i < NYIELD; i++)
+			sys_yield();
+		end = read_tsc();
+
+		cprintf("yieldbench: %4d blocked envs: %llu cycles/yield\n",
+			nblocked, (end - start) / NYIELD);
+	}
+
+	for (i = 0; i < nblocked; i++)
+		sys_env_destroy(blocked[i]);
+	cprintf("yieldbench done\n");
+}
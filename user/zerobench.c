@@ -0,0 +1,70 @@
+// Measure the cost of getting zeroed memory: sys_page_alloc of private
+// pages against mappings of the shared zero page, the first-write fault
+// on zero-mapped bss, and the latency of spawning a program with a
+// large bss.  Let the machine sit idle for a moment first, so that the
+// prezeroed pool has been filled.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	256
+#define NSPAWN	16
+#define REGION	((char *) 0x20000000)
+
+static char bss[NPAGES * PGSIZE];
+
+static uint64_t
+time_alloc(int perm)
+{
+	uint64_t start;
+	int i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE, perm)) < 0)
+			panic("sys_page_alloc: %e", r);
+	return (read_tsc() - start) / NPAGES;
+}
+
+static void
+unmap_region(void)
+{
+	int i;
+
+	for (i = 0; i < NPAGES; i++)
+		sys_page_unmap(0, REGION + i * PGSIZE);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, priv, zero, fault, spawnt;
+	envid_t who;
+	int i;
+
+	if (argc > 1)
+		return;		// Spawned child: nothing to do
+
+	priv = time_alloc(PTE_P|PTE_U|PTE_W);
+	unmap_region();
+	zero = time_alloc(PTE_P|PTE_U|PTE_COW);
+	unmap_region();
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		bss[i * PGSIZE] = 1;
+	fault = (read_tsc() - start) / NPAGES;
+
+	start = read_tsc();
+	for (i = 0; i < NSPAWN; i++) {
+		if ((who = spawnl("/zerobench", "zerobench", "child", 0)) < 0)
+			panic("spawn: %e", who);
+		wait(who);
+	}
+	spawnt = (read_tsc() - start) / NSPAWN;
+
+	cprintf("zerobench: page_alloc %llu cycles, zero page %llu cycles, "
+		"first write %llu cycles/page\n", priv, zero, fault);
+	cprintf("zerobench: spawn+exit with %d KB bss %llu cycles\n",
+		NPAGES * PGSIZE / 1024, spawnt);
+}